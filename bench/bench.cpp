@@ -0,0 +1,181 @@
+#include "parser.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <sstream>
+#include <sys/resource.h>
+
+// fixed workloads so numbers can be compared between runs and releases.
+// every op is one full Parser::parse (compile + run) on a fresh Parser
+struct Workload {
+    const char *name;
+    int iterations;
+    const char *src;
+};
+
+static const Workload workloads[] = {
+    {"arith_loop", 20,
+        "0 var i "
+        "loop {"
+        "    i 1 + var i"
+        "    i 100000 = if {break}"
+        "}"},
+    {"stack_loop", 20,
+        "0 "
+        "loop {"
+        "    1 +"
+        "    dup 100000 = if {break}"
+        "}"},
+    {"fizzbuzz", 20,
+        "1 var i "
+        "loop {"
+        "    0 var done"
+        "    i 15 % 0 = if { \"FizzBuzz\" print 1 var done }"
+        "    done ! i 3 % 0 = & if { \"Fizz\" print 1 var done }"
+        "    done ! i 5 % 0 = & if { \"Buzz\" print 1 var done }"
+        "    done ! if { i print }"
+        "    \"\n\" print"
+        "    i 1 + var i"
+        "    i 10000 > if {break}"
+        "}"},
+    {"recursion", 200,
+        "func sum n {"
+        "    n 0 = if { 0 }"
+        "    n 0 > if { n 1 - sum n + }"
+        "}"
+        "1000 sum"},
+    {"string_concat", 20,
+        "\"\" var s "
+        "0 "
+        "loop {"
+        "    s \"abcdefghijklmnop\" + var s"
+        "    1 + dup 2000 = if {break}"
+        "}"},
+    {"stack_shuffle", 20,
+        "1 2 3 0 var i "
+        "loop {"
+        "    over pop swap twodup pop pop dup pop"
+        "    i 1 + var i"
+        "    i 100000 = if {break}"
+        "}"},
+};
+
+struct Result {
+    const char *name;
+    int iterations;
+    double ns_per_op;
+    double min_ns_per_op;
+    double tokens_per_sec;
+    long peak_rss_kb;
+};
+
+// lexer throughput on the workload's source, the runs themselves are dominated by execution
+static double lex_tokens_per_sec(const char *src) {
+    typedef std::chrono::steady_clock clock;
+    const int passes = 1000;
+
+    std::string raw = src;
+    SourceCode code = SourceCode(raw);
+    Parser parser;
+    size_t tokens = 0;
+
+    clock::time_point start = clock::now();
+    for (int i = 0; i < passes; i++) {
+        code.reset_idx();
+        while (parser.gettok(code) != tok_eof)
+            tokens++;
+    }
+    double ns = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+    return tokens * 1e9 / ns;
+}
+
+static long peak_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss; // kilobytes on linux
+}
+
+static bool run_workload(const Workload &w, int scale, Result &result) {
+    typedef std::chrono::steady_clock clock;
+
+    int iterations = w.iterations * scale;
+    double total_ns = 0, min_ns = 0;
+    for (int i = 0; i < iterations; i++) {
+        std::string raw = w.src;
+        SourceCode src = SourceCode(raw);
+        Parser parser;
+        std::string output; // keeps print heavy workloads from measuring the terminal
+        parser.set_output(output);
+
+        clock::time_point start = clock::now();
+        int status = parser.parse(src);
+        double ns = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+
+        if (status != 0)
+            return false;
+        total_ns += ns;
+        if (i == 0 || ns < min_ns)
+            min_ns = ns;
+    }
+
+    result.name = w.name;
+    result.iterations = iterations;
+    result.ns_per_op = total_ns / iterations;
+    result.min_ns_per_op = min_ns;
+    result.tokens_per_sec = lex_tokens_per_sec(w.src);
+    result.peak_rss_kb = peak_rss_kb();
+    return true;
+}
+
+int main(int argc, char **argv) {
+    bool json = false;
+    const char *filter = nullptr;
+    int scale = 1;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--json")) {
+            json = true;
+        } else if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (!strcmp(argv[i], "--scale") && i + 1 < argc) {
+            scale = std::max(1, atoi(argv[++i]));
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--json] [--filter name] [--scale n]\n";
+            return 1;
+        }
+    }
+
+    std::vector<Result> results;
+    for (const Workload &w : workloads) {
+        if (filter && !strstr(w.name, filter))
+            continue;
+
+        Result result;
+        if (!run_workload(w, scale, result)) {
+            std::cerr << "workload " << w.name << " failed\n";
+            return 1;
+        }
+        results.push_back(result);
+    }
+
+    if (json) {
+        std::cout << "{\n  \"benchmarks\": [\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            const Result &r = results[i];
+            std::cout << "    {\"name\": \"" << r.name << "\", "
+                      << "\"iterations\": " << r.iterations << ", "
+                      << "\"ns_per_op\": " << (long long)r.ns_per_op << ", "
+                      << "\"min_ns_per_op\": " << (long long)r.min_ns_per_op << ", "
+                      << "\"tokens_per_sec\": " << (long long)r.tokens_per_sec << ", "
+                      << "\"peak_rss_kb\": " << r.peak_rss_kb << "}"
+                      << (i + 1 < results.size() ? ",\n" : "\n");
+        }
+        std::cout << "  ]\n}\n";
+    } else {
+        printf("%-16s %10s %14s %14s %16s %12s\n", "name", "iters", "ns/op", "min ns/op", "lex tokens/sec", "rss (KB)");
+        for (const Result &r : results) {
+            printf("%-16s %10d %14.0f %14.0f %16.0f %12ld\n", r.name, r.iterations, r.ns_per_op, r.min_ns_per_op,
+                   r.tokens_per_sec, r.peak_rss_kb);
+        }
+    }
+    return 0;
+}
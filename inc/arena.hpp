@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+// bump allocator for data that lives exactly as long as the program that owns it.
+// nothing is freed on its own, every block goes at once when the Arena does or is cleared
+struct Arena
+{
+    private:
+    static const size_t first_block = 4096;
+    static const size_t max_block = 1 << 16;
+
+    std::vector<char *> blocks;
+    char *cur = nullptr;
+    char *end = nullptr;
+    size_t next_block = first_block;
+
+    // starts a new block with room for at least n bytes
+    void grow(size_t n);
+    void release();
+
+    public:
+    Arena() = default;
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+    Arena(Arena &&other);
+    Arena &operator=(Arena &&other);
+
+    ~Arena()
+    {
+        release();
+    }
+
+    void *allocate(size_t n, size_t align);
+
+    // frees everything allocated so far. the last block is kept and refilled from its start
+    void clear();
+
+    // copies n trivially copyable Ts into the arena. data may be null if n is 0
+    template <typename T>
+    T *copy(const T *data, size_t n)
+    {
+        T *p = (T *)allocate(n * sizeof(T), alignof(T));
+        if (n)
+            memcpy(p, data, n * sizeof(T));
+        return p;
+    }
+};
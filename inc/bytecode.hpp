@@ -0,0 +1,164 @@
+#pragma once
+
+#include "source_code.hpp"
+#include "arena.hpp"
+
+// instructions produced by Parser::compile_block and executed by Parser::run.
+// when adding one, also add it to the dispatch table at the top of Parser::run
+// and to opcode_names in opcode_stats.cpp
+enum OpCode
+{
+    op_push_int,       // operand: the integer literal
+    op_push_str,       // operand: index into Program::strings
+    op_print,
+    op_flush,
+    op_func,           // operand: index into Program::funcs
+    op_var,            // operand: symbol id of the variable name
+    op_identifier,     // operand: symbol id of the variable/function name
+    op_load_local,     // operand: argument index in the current call frame
+    op_store_local,    // operand: argument index in the current call frame
+
+    // control flow, jump operands are absolute indices into Program::code
+    op_jump,           // loop back edges and breaks inside loops
+    op_jump_if_false,  // if, pops the condition
+    op_break,          // break outside of any loop, stops the current function/program
+    op_return,         // end of a function body or of a top level program
+
+    // stack commands
+    op_dup,
+    op_swap,
+    op_over,
+    op_twodup,
+    op_pop,
+
+    // binary operators
+    op_index,
+    op_add,
+    op_sub,
+    op_mul,
+    op_div,
+    op_mod,
+    op_pow,
+    op_lt,
+    op_gt,
+    op_eq,
+    op_and,
+    op_or,
+
+    // unary operators
+    op_not,
+
+    // superinstructions, only produced by Parser::optimize
+    op_add_const,              // push_int K, add. operand: K
+    op_sub_const,              // push_int K, sub. operand: K
+    op_eq_const_branch,        // push_int K, eq, jump_if_false. operand: K, operand2: jump target
+    op_lt_const_branch,
+    op_gt_const_branch,
+    op_dup_eq_const_branch,    // dup followed by one of the above, leaves the compared value on the stack
+    op_dup_lt_const_branch,
+    op_dup_gt_const_branch,
+    op_mul_locals,             // load_local a, load_local b, mul. operand: a, operand2: b
+
+    // inserted by Parser::insert_stack_checks. operand: required depth, operand2: the guarded OpCode
+    op_check_depth,
+
+    // quickened forms, only ever written by Parser::run over the generic instruction once it has
+    // seen its operand types, and rewritten back to the generic one if they change
+    op_add_int,
+    op_add_str,
+    op_sub_int,
+    op_mul_int,
+    op_lt_int,
+    op_gt_int,
+    op_eq_int,
+    op_add_const_int,
+    op_sub_const_int,
+
+    // inline caches written over op_identifier once it has resolved the name, only valid
+    // while operand2 equals Parser::names_epoch, otherwise they go back to op_identifier
+    op_call,           // operand: index into Program::funcs
+    op_load_var,       // operand: symbol id of the variable
+
+    // written over a hot loop back edge once Jit compiled the loop (only with PRINGLE_JIT).
+    // operand: the loop head, operand2: the Jit handle
+    op_jit_loop,
+
+    op_count
+};
+
+struct Instr
+{
+    OpCode op;
+    int operand;
+    int operand2; // only used by superinstructions
+    int line;     // source line it was compiled from
+};
+
+// characters owned by one of a Program's arenas, not terminated
+struct ArenaString
+{
+    const char *data;
+    size_t size;
+
+    std::string str() const
+    {
+        return std::string(data, size);
+    }
+
+    bool operator==(const ArenaString &other) const
+    {
+        return size == other.size && !memcmp(data, other.data, size);
+    }
+
+    friend std::ostream &operator<<(std::ostream &os, const ArenaString &s)
+    {
+        return os.write(s.data, s.size);
+    }
+};
+
+struct ArenaStringHash
+{
+    size_t operator()(const ArenaString &s) const
+    {
+        size_t h = 2166136261u;
+        for (size_t i = 0; i < s.size; i++)
+        {
+            h = (h ^ (unsigned char)s.data[i]) * 16777619u;
+        }
+        return h;
+    }
+};
+
+struct FuncDef
+{
+    int name;                         // symbol id
+    const int *arg_names = nullptr;   // argc symbol ids in the Program's code_arena
+    size_t argc = 0;
+    size_t entry = 0;                 // index into Program::code
+    size_t end = 0;                   // one past the body's op_return, equal to entry if it was dropped
+};
+
+// everything compiled out of the sources a Parser has been given so far
+struct Program
+{
+    // identifier names, kept when Parser::reset drops the code
+    Arena arena;
+    // string literals and argument lists, they go with the code
+    Arena code_arena;
+
+    std::vector<Instr> code;
+    std::vector<ArenaString> strings; // string literals, each distinct one stored once
+    std::unordered_map<ArenaString, int, ArenaStringHash> string_ids;
+
+    // every identifier is interned to a dense symbol id at compile time
+    std::vector<ArenaString> symbols;
+    std::unordered_map<ArenaString, int, ArenaStringHash> symbol_ids;
+    std::vector<FuncDef> funcs;
+};
+
+// how many values op needs on the stack and by how much it changes the depth.
+// op_identifier is left to the caller, a function call can leave any depth behind
+void stack_effect(OpCode op, int &need, int &delta);
+
+// the instructions that can run right after code[i], returns how many it wrote to next
+int successors(const std::vector<Instr> &code, size_t i, size_t next[2]);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "bytecode.hpp"
+
+#include <cstdint>
+
+// compiled programs saved to disk so a script that hasn't changed skips the lexer
+// and compiler. the file holds Program::code, strings, symbols and funcs in native
+// byte order behind a header with a format version, the OpCode count, the content
+// hash of the source it was compiled from and a checksum of the rest of the file;
+// anything that doesn't match (or doesn't parse, or could make the VM misbehave)
+// is ignored and the script is compiled again
+
+// 64-bit FNV-1a over the script's bytes
+uint64_t hash_source(const char *data, size_t len);
+
+// writes program as compiled from a source with this hash. the file is replaced
+// atomically, returns false if it can't be written
+bool save_program(const std::string &path, const Program &program, uint64_t hash);
+
+// maps a cache file and replaces program with its contents if it was written
+// for a source with this hash by this version, returns false otherwise
+bool load_program(const std::string &path, uint64_t hash, Program &program);
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "bytecode.hpp"
+#include "type.hpp"
+
+// the JIT only exists when configured with PRINGLE_JIT on x86-64 Linux, everywhere
+// else Jit::compile always fails and the interpreter runs everything
+#if defined(PRINGLE_JIT) && defined(__x86_64__) && defined(__linux__)
+#define PRINGLE_JIT_ENABLED 1
+#else
+#define PRINGLE_JIT_ENABLED 0
+#endif
+
+// what compiled loop code reads and updates, filled in by Parser::run on entry.
+// the layout is baked into the generated code
+struct JitState
+{
+    Value *stack;     // operand stack, slots [depth, limit) are free for pushes
+    size_t depth;
+    size_t limit;
+    Value *variables; // indexed by symbol id
+    Value *locals;    // the current call frame
+};
+
+// baseline template JIT for hot loops. a loop is the bytecode between a back edge
+// and its target, and only gets compiled if everything in it is int arithmetic,
+// comparisons, stack commands, jumps inside the loop and variable/argument loads
+// and stores. the native code keeps every Value in place exactly like the
+// interpreter would, so whenever it meets something it can't do (a string, a
+// missing variable, a full stack, division by zero) it stops and hands the
+// instruction back to the interpreter
+struct Jit
+{
+    private:
+    struct Loop
+    {
+        void *mapping;
+        size_t mapping_len;
+        size_t (*entry)(JitState *);
+        size_t exit;                 // pc right after the back edge
+        std::vector<int> variables;  // symbols read as variables, must not become functions
+        unsigned long entries = 0;
+        unsigned long bails = 0;
+    };
+
+    std::vector<Loop> loops;
+
+    public:
+    // back edges taken before a loop gets compiled
+    static const int threshold = 100;
+
+    // free stack slots handed to compiled code on every entry
+    static const size_t stack_slack = 256;
+
+    Jit() = default;
+    Jit(const Jit &) = delete;
+    Jit &operator=(const Jit &) = delete;
+
+    ~Jit()
+    {
+        clear();
+    }
+
+    // frees every compiled loop, the handles in the code that used them must be gone
+    void clear();
+
+    // compiles the loop program.code[head, back_edge], returns its handle or -1
+    // if it uses anything the JIT doesn't support
+    int compile(const Program &program, size_t head, size_t back_edge, const std::vector<int> &functions);
+
+    // false once the loop can't be used any more: a name it reads as a variable
+    // has been defined as a function, or it keeps falling back to the interpreter
+    bool usable(int loop, const std::vector<int> &functions) const;
+
+    // runs the loop from its head, returns the pc the interpreter continues at
+    size_t enter(int loop, JitState &state);
+};
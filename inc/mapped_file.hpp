@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+
+// read-only contents of a whole file. regular files are mmap'd, anything that
+// can't be mapped (stdin, pipes, empty files) is read into memory instead
+struct MappedFile
+{
+    private:
+    const char *mapping = nullptr;
+    size_t mapping_len = 0;
+    std::string buffer;
+
+    public:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+        close();
+    }
+
+    // "-" reads stdin. returns false if the file can't be opened or read
+    bool open(const char *path);
+
+    void close();
+
+    const char *data() const
+    {
+        return mapping ? mapping : buffer.data();
+    }
+
+    size_t size() const
+    {
+        return mapping ? mapping_len : buffer.size();
+    }
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "bytecode.hpp"
+
+#include <cstdint>
+
+// instrumentation build (configure with -DPRINGLE_OPCODE_STATS=ON): the VM counts every
+// instruction it dispatches and how long each one took. compiled out otherwise, the
+// VM's hooks expand to nothing and Parser doesn't even have the counters
+#ifdef PRINGLE_OPCODE_STATS
+
+struct OpcodeStats
+{
+    // bucket i counts executions that took [2^i, 2^(i+1)) ticks
+    static const int buckets = 32;
+
+    unsigned long long counts[op_count] = {};
+    unsigned long long histogram[op_count][buckets] = {};
+    unsigned long long calls = 0;
+    unsigned long long loop_iterations = 0; // back edges taken by the interpreter
+
+    // cycle counter where there is one, nanoseconds otherwise
+    static uint64_t now();
+    static const char *clock_name();
+
+    void record(OpCode op, uint64_t ticks)
+    {
+        int bucket = 0;
+        while (ticks > 1 && bucket < buckets - 1)
+        {
+            ticks >>= 1;
+            bucket++;
+        }
+        counts[op]++;
+        histogram[op][bucket]++;
+    }
+
+    void write_json(std::ostream &os) const;
+};
+
+#endif
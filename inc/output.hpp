@@ -0,0 +1,53 @@
+#pragma once
+
+#include "type.hpp"
+#include <unistd.h>
+
+// buffered destination for everything a Parser prints. batches writes to a
+// file descriptor (stdout by default) or collects them in a string
+struct Output : std::streambuf {
+    private:
+    static const size_t capacity = 1 << 16;
+
+    std::vector<char> buf;
+    int fd = STDOUT_FILENO;
+    std::string *sink = nullptr; // if set, fd is unused
+
+    void drain();
+
+    protected:
+    int overflow(int c) override;
+    std::streamsize xsputn(const char *s, std::streamsize n) override;
+    int sync() override;
+
+    public:
+    Output() : buf(capacity) {
+        setp(buf.data(), buf.data() + buf.size());
+    }
+
+    ~Output() {
+        drain();
+    }
+
+    void to_fd(int fd_in) {
+        drain();
+        fd = fd_in;
+        sink = nullptr;
+    }
+
+    void to_string(std::string &sink_in) {
+        drain();
+        sink = &sink_in;
+    }
+
+    void write(const char *s, size_t n) {
+        sputn(s, n);
+    }
+
+    // ints are formatted in place, strings are copied straight from the Value
+    void write(const Value &v);
+
+    void flush() {
+        drain();
+    }
+};
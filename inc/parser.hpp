@@ -2,47 +2,170 @@
 
 #include "source_code.hpp"
 #include "type.hpp"
+#include "bytecode.hpp"
+#include "output.hpp"
+#include "jit.hpp"
+#include "profiler.hpp"
+#include "opcode_stats.hpp"
 
 struct Parser {
     private:
-    std::unordered_set<int> operators = {'.', '+', '-', '*', '/', '^', '%', '=', '<', '>', '!', '|', '&'};
-
     std::string identifier_str; // Filled in if tok_identifier
     int num_val;             // Filled in if tok_number
-    std::string str_val; // Filled in if tok_string
-
-    std::stack<Value> stack;
-    std::unordered_map<std::string, SourceCode> functions;
-    std::unordered_map<std::string, Value> variables;
-
-    std::unordered_map<std::string, Token> command_to_token = {
-        {"print", tok_print},
-        {"func", tok_func},
-        {"var", tok_var},
-        {"loop", tok_loop},
-        {"break", tok_break},
-        {"if", tok_if},
-        {"dup", tok_dup},
-        {"swap", tok_swap},
-        {"over", tok_over},
-        {"twodup", tok_twodup},
-        {"pop", tok_pop},
+    const char *str_start;   // Filled in if tok_string, span into the source being lexed
+    size_t str_len;
+    const char *token_start; // where the last token began
+
+    // line numbers are counted lazily, up to line_scan so far
+    const char *line_scan = nullptr;
+    int line = 1;
+
+    // line of the last token
+    int source_line();
+
+    static const size_t stack_reserve = 1024;
+
+    std::vector<Value> stack; // operand stack, top is back()
+    // both indexed by symbol id, grown to program.symbols.size() after every compile
+    std::vector<int> functions;   // index into program.funcs, -1 if no function has that name
+    std::vector<Value> variables; // type_none if no variable has that name
+
+    // program.strings as Values, filled in before each run so op_push_str only shares one
+    std::vector<Value> literals;
+
+    // moves whenever func or var defines a new name, which invalidates what every
+    // op_call/op_load_var cached about a name
+    unsigned names_epoch = 0;
+
+    // function arguments, each call gets a frame of slots starting at frame_base
+    std::vector<Value> locals;
+    size_t frame_base = 0;
+
+    // calls in progress, innermost last. calls don't recurse into run, so the
+    // depth of pringle recursion is only limited by these two vectors
+    struct Frame
+    {
+        size_t return_pc;
+        size_t frame_base; // the caller's
     };
+    std::vector<Frame> frames;
+
+    Program program;
+
+    Jit jit; // native code for hot loops, unused unless built with PRINGLE_JIT
+
+    Profiler *profiler = nullptr; // gets a sample whenever Profiler::pending is set
+
+    // records the call stack with pc as the instruction about to run
+    void sample(size_t pc);
+
+#ifdef PRINGLE_OPCODE_STATS
+    OpcodeStats stats;
+#endif
+
+    Output out;              // print and error messages, flushed at the end of every parse
+    std::ostream diag{&out}; // formatted error messages into out
+
+    // copies a string literal into the program, returns its index in program.strings
+    int add_string(const char *data, size_t len);
+
+    // returns the symbol id of name, allocating the next one if it is new
+    int intern(const std::string &name);
+
+    // index into program.funcs of the function body being compiled, -1 at the top level
+    int arg_scope = -1;
+
+    // argument names of a func being compiled, before they are copied into the arena
+    std::vector<int> arg_buffer;
+
+    // returns the frame slot of an argument named by symbol, or -1 if it is not one
+    int local_slot(int symbol);
+
+    void emit(OpCode op, int operand = 0) {
+        program.code.push_back({op, operand, 0, source_line()});
+    }
+
+    // compiles src up to the closing '}' (or EOF if !nested) into program.code, returns 0 or -1 on error.
+    // breaks collects the jumps emitted for break inside the innermost loop, nullptr outside of loops
+    int compile_block(SourceCode &src, bool nested, std::vector<size_t> *breaks);
+
+    // load time pass over program.code[start, end): folds literal arithmetic and comparisons,
+    // resolves if on a literal and replaces common short sequences with superinstructions
+    void optimize(size_t start);
+
+    // stack depth analysis over program.code[start, end), guards every instruction that could
+    // underflow the stack with an op_check_depth so the handlers themselves don't have to check
+    void insert_stack_checks(size_t start);
+
+    // compiles a whole source, returns the index of its first instruction or -1 on error
+    int compile(SourceCode &src);
+
+    // runs compiled top level code from pc until its op_return, returns 0 when done, 1 on error, 2 on break
+    int run(size_t pc);
+
+    // runs a compiled program from entry the way parse does: reports type errors, flushes output
+    int execute(size_t entry);
 
     public:
 
+    Parser() {
+        stack.reserve(stack_reserve);
+        locals.reserve(stack_reserve);
+        frames.reserve(stack_reserve);
+    }
+
     int gettok(SourceCode &src);
 
+    // send print output to a file descriptor (stdout by default) or append it to sink
+    void set_output(int fd) {
+        out.to_fd(fd);
+    }
+
+    void set_output(std::string &sink) {
+        out.to_string(sink);
+    }
+
+    void flush() {
+        out.flush();
+    }
+
+    // samples taken while running go to profiler, nullptr turns that off
+    void set_profiler(Profiler *p) {
+        profiler = p;
+    }
+
+    const Program &get_program() const {
+        return program;
+    }
+
+#ifdef PRINGLE_OPCODE_STATS
+    const OpcodeStats &get_stats() const {
+        return stats;
+    }
+#endif
+
     int parse(SourceCode &src);
+
+    // forgets everything the scripts run so far compiled, defined and left on the stack, so
+    // the next parse behaves like it would on a new Parser. cheaper than one: the interned
+    // names, the capacity of every buffer and the output target are kept. string literals
+    // are dropped, and so are the names once there are more than reset_symbol_limit
+    void reset();
+    static const size_t reset_symbol_limit = 4096;
+
+    // like parse, but if cache_file holds this exact source compiled by this version,
+    // runs that instead of compiling. otherwise compiles and saves the result there.
+    // only a parser that hasn't been given any source yet uses the cache
+    int parse_cached(SourceCode &src, const std::string &cache_file);
  
     std::stack<Value> get_stack() {
-        return stack;
+        return std::stack<Value>(std::deque<Value>(stack.begin(), stack.end()));
     }
 
     Value try_peek(){
         if (stack.empty())
             throw std::runtime_error("Cannot peek empty stack");
-        return stack.top();
+        return stack.back();
     }
 
 };
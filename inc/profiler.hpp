@@ -0,0 +1,57 @@
+#pragma once
+
+#include "bytecode.hpp"
+
+#include <csignal>
+#include <map>
+
+// sampling profiler for pringle code. while running, a CPU time timer raises SIGPROF
+// every interval; the handler only sets pending, and the VM records the call stack
+// at the next instruction it dispatches (compiled loops check in when they exit)
+struct Profiler
+{
+    private:
+    // pcs of every active function, outermost first: the call sites, then the pc that
+    // was about to run. counted per distinct stack
+    std::map<std::vector<size_t>, unsigned long> samples;
+    unsigned long total = 0;
+    long interval_us = 0;
+    struct sigaction saved_action;
+    bool running = false;
+
+    // name of the innermost function whose body contains pc
+    static std::string function_at(const Program &program, size_t pc);
+
+    public:
+    static volatile sig_atomic_t pending;
+
+    Profiler() = default;
+    Profiler(const Profiler &) = delete;
+    Profiler &operator=(const Profiler &) = delete;
+
+    ~Profiler()
+    {
+        stop();
+    }
+
+    // returns false if the timer can't be set up
+    bool start(long interval = 1000);
+    void stop();
+
+    void record(const std::vector<size_t> &stack)
+    {
+        samples[stack]++;
+        total++;
+    }
+
+    unsigned long sample_count() const
+    {
+        return total;
+    }
+
+    // self samples per function and per function:line, most first
+    void write_flat(std::ostream &os, const Program &program) const;
+
+    // one "outer;inner;innermost count" line per stack, as read by flamegraph.pl and friends
+    void write_collapsed(std::ostream &os, const Program &program) const;
+};
@@ -7,6 +7,7 @@
 #include <stack>
 #include <vector>
 #include <cmath>
+#include <climits>
 #include <unordered_set>
 #include <unordered_map>
 
@@ -33,13 +34,17 @@ enum Token
     tok_over = -13,
     tok_twodup = -14,
     tok_pop = -15,
+
+    tok_flush = -16,
 };
 
 struct SourceCode
 {
     private:
     std::string raw;
-    int idx = 0;
+    const char *view = nullptr; // if set, the source is view[0, view_len) and raw is unused
+    size_t view_len = 0;
+    size_t idx = 0;
     std::vector<std::string> arg_names;
 
     public:
@@ -58,11 +63,53 @@ struct SourceCode
     // for some reason a constructor with no arguments gets called, and this is working fine :/
     SourceCode() = default;
 
+    // non-owning, the buffer (e.g. a MappedFile) has to outlive the SourceCode
+    static SourceCode from_view(const char *data, size_t len)
+    {
+        SourceCode src;
+        src.view = data;
+        src.view_len = len;
+        return src;
+    }
+
+    const char *data() const
+    {
+        return view ? view : raw.data();
+    }
+
+    size_t size() const
+    {
+        return view ? view_len : raw.size();
+    }
+
     char get_char()
     {
-        if (idx == raw.length())
+        if (idx == size())
             return EOF;
-        return raw[idx++];
+        return data()[idx++];
+    }
+
+    char peek_char()
+    {
+        if (idx == size())
+            return EOF;
+        return data()[idx];
+    }
+
+    // raw access for the lexer, which scans the buffer in place
+    const char *cursor() const
+    {
+        return data() + idx;
+    }
+
+    const char *end() const
+    {
+        return data() + size();
+    }
+
+    void seek(const char *pos)
+    {
+        idx = pos - data();
     }
 
     std::vector<std::string> get_arg_names() 
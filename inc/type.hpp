@@ -1,44 +1,148 @@
 #pragma once
 
 #include "source_code.hpp"
+#include <cstring>
+#include <new>
+#include <stdexcept>
 
 enum Type {
+    type_none = -1, // default constructed, e.g. a variable slot that was never assigned
     type_int = 0,
     type_string = 1,
 };
 
+// tagged union, type errors throw std::invalid_argument.
+// strings are immutable: up to small_capacity chars are stored inline, longer ones in a
+// refcounted buffer that copies of the Value share, so copying any Value is O(1)
 struct Value {
     private:
-    int type;
-    int val_int;
-    std::string val_string;
+    static const size_t small_capacity = 8;
+
+    // header of a heap string, the chars follow it in the same allocation
+    struct Shared {
+        size_t refs;
+        size_t size;
+
+        char *data() {
+            return reinterpret_cast<char *>(this + 1);
+        }
+    };
+
+    signed char type = type_none;
+    bool heap = false;           // string lives in val_heap instead of small
+    unsigned char small_len = 0; // length of an inline string
+    union {
+        int val_int = 0;
+        Shared *val_heap;
+        char small[small_capacity];
+    };
+
+    // makes this a string of len chars and returns where to write them
+    char *init_string(size_t len);
+    void set_string(const char *data, size_t len);
+    void copy_from(const Value &other);
+    void release() {
+        if (heap && --val_heap->refs == 0)
+            ::operator delete(val_heap);
+        heap = false;
+    }
 
     public:
     Value() = default;
 
-    Value(int val_int_in) {
-        type = type_int;
-        val_int = val_int_in;
+    Value(int val_int_in) : type(type_int), val_int(val_int_in) {}
+
+    Value(const std::string &val_string_in) {
+        set_string(val_string_in.data(), val_string_in.size());
     }
 
-    Value(std::string val_string_in) {
-        type = type_string;
-        val_string = val_string_in;
+    Value(const char *data, size_t len) {
+        set_string(data, len);
     }
 
     Value(char val_string_in) { // char is coerced to string
-        type = type_string;
-        val_string = val_string_in;
+        set_string(&val_string_in, 1);
+    }
+
+    Value(const Value &other) {
+        copy_from(other);
+    }
+
+    Value(Value &&other) : type(other.type), heap(other.heap), small_len(other.small_len) {
+        memcpy(small, other.small, small_capacity); // covers val_int and val_heap too
+        other.type = type_none;
+        other.heap = false;
+    }
+
+    Value &operator=(const Value &other) {
+        if (this != &other) {
+            release();
+            copy_from(other);
+        }
+        return *this;
+    }
+
+    Value &operator=(Value &&other) {
+        if (this != &other) {
+            release();
+            type = other.type;
+            heap = other.heap;
+            small_len = other.small_len;
+            memcpy(small, other.small, small_capacity);
+            other.type = type_none;
+            other.heap = false;
+        }
+        return *this;
+    }
+
+    ~Value() {
+        release();
+    }
+
+    int get_type() const {
+        return type;
     }
 
-    int get_type();
     int get_int() const;
     std::string get_string() const;
 
+    // unchecked fast paths for the interpreter, as_int and set_int are only valid if is_int()
+    bool is_int() const {
+        return type == type_int;
+    }
+
+    int as_int() const {
+        return val_int;
+    }
+
+    void set_int(int v) {
+        val_int = v;
+    }
+
+    // both must be strings
+    static Value concat(const Value &a, const Value &b);
+
+    // the character at index i as a one char string, without copying the rest
+    Value char_at(int i) const;
+
+    // unchecked, only valid if get_type() == type_string
+    const char *string_data() const {
+        return heap ? val_heap->data() : small;
+    }
+
+    size_t string_size() const {
+        return heap ? val_heap->size : small_len;
+    }
+
     friend std::ostream& operator<<(std::ostream& os, const Value& v);
 
+    // generated code reads and writes int Values in place
+    friend struct Jit;
+
     std::string to_string() const;
 
     bool operator==(int i) const;
     bool operator==(std::string s) const;
 };
+
+static_assert(sizeof(Value) <= 16, "Value should stay two words wide");
@@ -0,0 +1,77 @@
+#include "arena.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+Arena::Arena(Arena &&other)
+    : blocks(std::move(other.blocks)), cur(other.cur), end(other.end), next_block(other.next_block)
+{
+    other.blocks.clear();
+    other.cur = other.end = nullptr;
+    other.next_block = first_block;
+}
+
+Arena &Arena::operator=(Arena &&other)
+{
+    if (this != &other)
+    {
+        release();
+        blocks = std::move(other.blocks);
+        cur = other.cur;
+        end = other.end;
+        next_block = other.next_block;
+        other.blocks.clear();
+        other.cur = other.end = nullptr;
+        other.next_block = first_block;
+    }
+    return *this;
+}
+
+void Arena::release()
+{
+    for (char *block : blocks)
+    {
+        free(block);
+    }
+    blocks.clear();
+    cur = end = nullptr;
+}
+
+void Arena::clear()
+{
+    if (blocks.empty())
+        return;
+    for (size_t i = 0; i + 1 < blocks.size(); i++)
+    {
+        free(blocks[i]);
+    }
+    blocks.erase(blocks.begin(), blocks.end() - 1);
+    cur = blocks[0];
+}
+
+void Arena::grow(size_t n)
+{
+    size_t size = n > next_block ? n : next_block;
+    char *block = (char *)malloc(size);
+    if (!block)
+        throw std::bad_alloc();
+    blocks.push_back(block);
+    cur = block;
+    end = block + size;
+    if (next_block < max_block)
+        next_block *= 2;
+}
+
+void *Arena::allocate(size_t n, size_t align)
+{
+    uintptr_t p = ((uintptr_t)cur + align - 1) & ~(uintptr_t)(align - 1);
+    if (!cur || p + n > (uintptr_t)end)
+    {
+        // malloc'd blocks are aligned for anything
+        grow(n);
+        p = (uintptr_t)cur;
+    }
+    cur = (char *)(p + n);
+    return (void *)p;
+}
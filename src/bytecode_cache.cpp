@@ -0,0 +1,370 @@
+#include "bytecode_cache.hpp"
+#include "mapped_file.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+namespace
+{
+
+const char magic[8] = {'p', 'r', 'i', 'n', 'g', 'l', 'e', 'c'};
+
+// bump whenever the layout below, or the meaning of an existing OpCode, changes
+const uint32_t format_version = 4;
+
+struct Writer
+{
+    std::string buf;
+
+    void u32(uint32_t v)
+    {
+        buf.append((const char *)&v, sizeof(v));
+    }
+
+    void u64(uint64_t v)
+    {
+        buf.append((const char *)&v, sizeof(v));
+    }
+
+    void str(const ArenaString &s)
+    {
+        u32(s.size);
+        buf.append(s.data, s.size);
+    }
+};
+
+// every read checks the bounds, ok turns false at the first one past the end
+struct Reader
+{
+    const char *cur;
+    const char *end;
+    bool ok = true;
+
+    Reader(const char *data, size_t len) : cur(data), end(data + len) {}
+
+    bool has(size_t n)
+    {
+        ok = ok && (size_t)(end - cur) >= n;
+        return ok;
+    }
+
+    uint32_t u32()
+    {
+        uint32_t v = 0;
+        if (has(sizeof(v)))
+        {
+            memcpy(&v, cur, sizeof(v));
+            cur += sizeof(v);
+        }
+        return v;
+    }
+
+    uint64_t u64()
+    {
+        uint64_t v = 0;
+        if (has(sizeof(v)))
+        {
+            memcpy(&v, cur, sizeof(v));
+            cur += sizeof(v);
+        }
+        return v;
+    }
+
+    // copied out of the mapping into arena
+    ArenaString str(Arena &arena)
+    {
+        uint32_t len = u32();
+        if (!has(len))
+            return {nullptr, 0};
+        ArenaString s = {arena.copy(cur, len), len};
+        cur += len;
+        return s;
+    }
+};
+
+// a damaged file must not make the VM read out of bounds. operands that index into the
+// program's tables are in range, control never leaves the function body it is in,
+// argument slots exist in the frame of that body and, as insert_stack_checks made sure
+// when compiling, every instruction that can run finds the stack depth it needs
+bool valid(const Program &program)
+{
+    size_t code = program.code.size();
+    if (code == 0 || program.code.back().op != op_return)
+        return false;
+
+    // owner[pc] is the innermost function whose body holds pc, -1 at the top level
+    std::vector<int> owner(code, -1);
+    for (size_t f = 0; f < program.funcs.size(); f++)
+    {
+        const FuncDef &func = program.funcs[f];
+        if ((size_t)func.name >= program.symbols.size() || func.entry >= code || func.end < func.entry ||
+            func.end > code)
+            return false;
+        for (size_t i = 0; i < func.argc; i++)
+        {
+            if ((size_t)func.arg_names[i] >= program.symbols.size())
+                return false;
+        }
+        for (size_t pc = func.entry; pc < func.end; pc++)
+        {
+            const FuncDef *outer = owner[pc] < 0 ? nullptr : &program.funcs[owner[pc]];
+            if (!outer || func.end - func.entry < outer->end - outer->entry)
+                owner[pc] = f;
+        }
+    }
+
+    for (size_t pc = 0; pc < code; pc++)
+    {
+        const Instr &instr = program.code[pc];
+        size_t operand = (size_t)instr.operand;
+        size_t operand2 = (size_t)instr.operand2;
+        size_t argc = owner[pc] < 0 ? 0 : program.funcs[owner[pc]].argc;
+        switch (instr.op)
+        {
+        case op_push_str:
+            if (operand >= program.strings.size())
+                return false;
+            break;
+        case op_func:
+            // only defined functions can be called, their body must be there
+            if (operand >= program.funcs.size() || program.funcs[operand].entry == program.funcs[operand].end)
+                return false;
+            break;
+        case op_var:
+        case op_identifier:
+            if (operand >= program.symbols.size())
+                return false;
+            break;
+        case op_load_local:
+        case op_store_local:
+            if (operand >= argc)
+                return false;
+            break;
+        case op_mul_locals:
+            if (operand >= argc || operand2 >= argc)
+                return false;
+            break;
+        case op_jump:
+        case op_jump_if_false:
+            if (operand >= code)
+                return false;
+            break;
+        case op_eq_const_branch:
+        case op_lt_const_branch:
+        case op_gt_const_branch:
+        case op_dup_eq_const_branch:
+        case op_dup_lt_const_branch:
+        case op_dup_gt_const_branch:
+            if (operand2 >= code)
+                return false;
+            break;
+        default:
+            // never saved, they only appear once the code has run
+            if (instr.op >= op_add_int)
+                return false;
+            break;
+        }
+    }
+
+    // the same depth bounds insert_stack_checks computes, from the program start and every body's entry
+    const int unvisited = INT_MAX;
+    std::vector<int> depth(code, unvisited);
+    std::vector<size_t> worklist;
+    if (owner[0] != -1)
+        return false;
+    depth[0] = 0;
+    worklist.push_back(0);
+    for (size_t f = 0; f < program.funcs.size(); f++)
+    {
+        const FuncDef &func = program.funcs[f];
+        if (func.entry == func.end)
+            continue;
+        if (owner[func.entry] != (int)f)
+            return false;
+        depth[func.entry] = 0;
+        worklist.push_back(func.entry);
+    }
+    while (!worklist.empty())
+    {
+        size_t pc = worklist.back();
+        worklist.pop_back();
+        const Instr &instr = program.code[pc];
+
+        int need, delta;
+        stack_effect(instr.op, need, delta);
+        if (depth[pc] < need)
+            return false;
+        int after = depth[pc] + delta;
+        if (instr.op == op_check_depth)
+            after = std::max(depth[pc], instr.operand);
+        else if (instr.op == op_identifier)
+            after = 0;
+
+        size_t next[2];
+        int n = successors(program.code, pc, next);
+        for (int k = 0; k < n; k++)
+        {
+            if (next[k] >= code || owner[next[k]] != owner[pc])
+                return false;
+            int &d = depth[next[k]];
+            if (d == unvisited || after < d)
+            {
+                d = after;
+                worklist.push_back(next[k]);
+            }
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+uint64_t hash_source(const char *data, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+bool save_program(const std::string &path, const Program &program, uint64_t hash)
+{
+    Writer w;
+    w.buf.append(magic, sizeof(magic));
+    w.u32(format_version);
+    w.u32(op_count);
+    w.u64(hash);
+    // checksum of everything after it, filled in once the rest is written
+    size_t checksum_at = w.buf.size();
+    w.u64(0);
+    w.u32(program.code.size());
+    w.u32(program.strings.size());
+    w.u32(program.symbols.size());
+    w.u32(program.funcs.size());
+
+    for (const Instr &instr : program.code)
+    {
+        w.u32(instr.op);
+        w.u32(instr.operand);
+        w.u32(instr.operand2);
+        w.u32(instr.line);
+    }
+    for (const ArenaString &s : program.strings)
+    {
+        w.str(s);
+    }
+    for (const ArenaString &s : program.symbols)
+    {
+        w.str(s);
+    }
+    for (const FuncDef &func : program.funcs)
+    {
+        w.u32(func.name);
+        w.u32(func.argc);
+        for (size_t i = 0; i < func.argc; i++)
+        {
+            w.u32(func.arg_names[i]);
+        }
+        w.u64(func.entry);
+        w.u64(func.end);
+    }
+
+    size_t payload = checksum_at + sizeof(uint64_t);
+    uint64_t checksum = hash_source(w.buf.data() + payload, w.buf.size() - payload);
+    memcpy(&w.buf[checksum_at], &checksum, sizeof(checksum));
+
+    // written beside the target and renamed over it, so runs of the same script
+    // in parallel never read half a file
+    std::string tmp = path + "." + std::to_string(getpid()) + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f)
+        return false;
+    bool written = fwrite(w.buf.data(), 1, w.buf.size(), f) == w.buf.size();
+    written = fclose(f) == 0 && written;
+    if (!written || rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        std::remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool load_program(const std::string &path, uint64_t hash, Program &program)
+{
+    MappedFile file;
+    if (!file.open(path.c_str()))
+        return false;
+
+    Reader r(file.data(), file.size());
+    if (!r.has(sizeof(magic)) || memcmp(r.cur, magic, sizeof(magic)) != 0)
+        return false;
+    r.cur += sizeof(magic);
+    if (r.u32() != format_version || r.u32() != op_count || r.u64() != hash)
+        return false;
+    uint64_t checksum = r.u64();
+    if (!r.ok || hash_source(r.cur, r.end - r.cur) != checksum)
+        return false;
+
+    uint32_t code = r.u32();
+    uint32_t strings = r.u32();
+    uint32_t symbols = r.u32();
+    uint32_t funcs = r.u32();
+    // each entry takes at least 4 bytes, don't reserve for counts the file can't hold
+    if (!r.has((size_t)code * 16 + ((size_t)strings + symbols + funcs) * 4))
+        return false;
+
+    Program loaded;
+    loaded.code.reserve(code);
+    for (uint32_t i = 0; i < code; i++)
+    {
+        Instr instr;
+        uint32_t op = r.u32();
+        if (op >= op_count)
+            return false;
+        instr.op = (OpCode)op;
+        instr.operand = (int)r.u32();
+        instr.operand2 = (int)r.u32();
+        instr.line = (int)r.u32();
+        loaded.code.push_back(instr);
+    }
+    loaded.strings.reserve(strings);
+    for (uint32_t i = 0; i < strings; i++)
+    {
+        loaded.strings.push_back(r.str(loaded.code_arena));
+        loaded.string_ids[loaded.strings.back()] = i;
+    }
+    loaded.symbols.reserve(symbols);
+    for (uint32_t i = 0; i < symbols; i++)
+    {
+        loaded.symbols.push_back(r.str(loaded.arena));
+        loaded.symbol_ids[loaded.symbols.back()] = i;
+    }
+    loaded.funcs.resize(funcs);
+    for (FuncDef &func : loaded.funcs)
+    {
+        func.name = (int)r.u32();
+        uint32_t argc = r.u32();
+        if (!r.has((size_t)argc * 4))
+            return false;
+        int *args = (int *)loaded.code_arena.allocate(argc * sizeof(int), alignof(int));
+        for (uint32_t i = 0; i < argc; i++)
+        {
+            args[i] = (int)r.u32();
+        }
+        func.arg_names = args;
+        func.argc = argc;
+        func.entry = r.u64();
+        func.end = r.u64();
+    }
+
+    if (!r.ok || r.cur != r.end || !valid(loaded))
+        return false;
+    program = std::move(loaded);
+    return true;
+}
@@ -0,0 +1,623 @@
+#include "jit.hpp"
+
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if PRINGLE_JIT_ENABLED
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+void Jit::clear()
+{
+#if PRINGLE_JIT_ENABLED
+    for (Loop &loop : loops)
+    {
+        munmap(loop.mapping, loop.mapping_len);
+    }
+#endif
+    loops.clear();
+}
+
+bool Jit::usable(int loop, const std::vector<int> &functions) const
+{
+    const Loop &l = loops[loop];
+    // mostly bailing out costs more than it saves
+    if (l.entries >= 64 && l.bails * 2 > l.entries)
+        return false;
+    for (int symbol : l.variables)
+    {
+        if (functions[symbol] >= 0)
+            return false;
+    }
+    return true;
+}
+
+size_t Jit::enter(int loop, JitState &state)
+{
+    Loop &l = loops[loop];
+    l.entries++;
+    size_t pc = l.entry(&state);
+    if (pc != l.exit)
+        l.bails++;
+    return pc;
+}
+
+#if !PRINGLE_JIT_ENABLED
+
+int Jit::compile(const Program &, size_t, size_t, const std::vector<int> &)
+{
+    return -1;
+}
+
+#else
+
+namespace
+{
+
+// where Value keeps its tag, heap flag and int, checked against the real layout in Jit::compile
+const int value_type = 0;
+const int value_heap = 1;
+const int value_int = 8;
+const int value_size = 16;
+
+// slots relative to rcx, which points one past the top of the stack
+const int top = -value_size;
+const int second = -2 * value_size;
+const int third = -3 * value_size;
+
+enum Reg
+{
+    rax = 0,
+    rcx = 1,
+    rdx = 2,
+};
+
+// x86-64 machine code for one loop. register use in the generated code:
+//   rbp  JitState *            r12  depth * sizeof(Value)
+//   rbx  JitState::stack       r13  limit * sizeof(Value)
+//   r14  JitState::variables   r15  JitState::locals
+// rax, rcx, rdx and r8 are scratch, every template that touches the stack
+// starts by pointing rcx one past its top slot
+struct Assembler
+{
+    std::vector<unsigned char> buf;
+
+    // (position of a rel32, pc it jumps to)
+    std::vector<std::pair<size_t, size_t>> jumps;
+    std::vector<std::pair<size_t, size_t>> bails;
+
+    void emit(std::initializer_list<unsigned char> bytes)
+    {
+        buf.insert(buf.end(), bytes);
+    }
+
+    void imm32(int32_t v)
+    {
+        unsigned char b[4];
+        memcpy(b, &v, 4);
+        buf.insert(buf.end(), b, b + 4);
+    }
+
+    static unsigned char modrm(int mod, int reg, int rm)
+    {
+        return (unsigned char)(mod << 6 | reg << 3 | rm);
+    }
+
+    // jmp/jcc opcode followed by a rel32 to the native code of bytecode pc
+    void jump_to(std::initializer_list<unsigned char> opcode, size_t pc)
+    {
+        emit(opcode);
+        jumps.push_back({buf.size(), pc});
+        imm32(0);
+    }
+
+    // jcc opcode followed by a rel32 that leaves the loop, the interpreter
+    // takes over at pc with the stack as it is
+    void bail_to(std::initializer_list<unsigned char> opcode, size_t pc)
+    {
+        emit(opcode);
+        bails.push_back({buf.size(), pc});
+        imm32(0);
+    }
+
+    void patch(size_t at, size_t target)
+    {
+        int32_t rel = (int32_t)(target - (at + 4));
+        memcpy(&buf[at], &rel, 4);
+    }
+
+    // lea rcx, [rbx + r12]
+    void top_slot()
+    {
+        emit({0x4A, 0x8D, 0x0C, 0x23});
+    }
+
+    // lea rdx, [r14 + symbol * 16] or [r15 + slot * 16]
+    void variable_slot(int symbol)
+    {
+        emit({0x49, 0x8D, 0x96});
+        imm32(symbol * value_size);
+    }
+
+    void local_slot(int slot)
+    {
+        emit({0x49, 0x8D, 0x97});
+        imm32(slot * value_size);
+    }
+
+    // bails out at pc unless there's room for n more slots:
+    // lea rax, [r12 + n * 16]; cmp rax, r13; ja
+    void need_slots(int n, size_t pc)
+    {
+        emit({0x49, 0x8D, 0x44, 0x24, (unsigned char)(n * value_size)});
+        emit({0x4C, 0x39, 0xE8});
+        bail_to({0x0F, 0x87}, pc);
+    }
+
+    // bails out at pc unless the Value at [base + disp] is an int:
+    // cmp byte [base + disp], type_int; jne
+    void expect_int(Reg base, int disp, size_t pc)
+    {
+        emit({0x80, modrm(1, 7, base), (unsigned char)(disp + value_type), (unsigned char)type_int});
+        bail_to({0x0F, 0x85}, pc);
+    }
+
+    // mov reg, dword [base + disp + value_int]
+    void load_int(Reg reg, Reg base, int disp)
+    {
+        emit({0x8B, modrm(1, reg, base), (unsigned char)(disp + value_int)});
+    }
+
+    // mov dword [base + disp + value_int], reg
+    void store_int(Reg reg, Reg base, int disp)
+    {
+        emit({0x89, modrm(1, reg, base), (unsigned char)(disp + value_int)});
+    }
+
+    // turns the Value at [base + disp] into an int, only valid if it doesn't own a string:
+    // mov qword [base + disp], 0 clears the tag (type_int), the heap flag and the small length
+    void int_header(Reg base, int disp)
+    {
+        emit({0x48, 0xC7, modrm(1, 0, base), (unsigned char)disp});
+        imm32(0);
+    }
+
+    // pushes eax as a new int slot, the caller has checked need_slots and set up rcx
+    void push_eax()
+    {
+        int_header(rcx, 0);
+        store_int(rax, rcx, 0);
+        emit({0x49, 0x83, 0xC4, (unsigned char)value_size}); // add r12, 16
+    }
+
+    void drop()
+    {
+        emit({0x49, 0x83, 0xEC, (unsigned char)value_size}); // sub r12, 16
+    }
+
+    // binds eax to the second and edx to the top slot, both checked to be ints
+    void int_operands(size_t pc)
+    {
+        top_slot();
+        expect_int(rcx, second, pc);
+        expect_int(rcx, top, pc);
+        load_int(rax, rcx, second);
+        load_int(rdx, rcx, top);
+    }
+
+    // writes eax over the second slot and drops the top one
+    void binary_result()
+    {
+        store_int(rax, rcx, second);
+        drop();
+    }
+
+    // eax = eax cc edx as 0/1: cmp eax, edx; setcc al; movzx eax, al
+    void compare(unsigned char setcc)
+    {
+        emit({0x39, 0xD0, 0x0F, setcc, 0xC0, 0x0F, 0xB6, 0xC0});
+    }
+
+    // eax = (eax != 0) op (edx != 0) for and/or
+    void logical(unsigned char op)
+    {
+        emit({0x85, 0xC0, 0x0F, 0x95, 0xC0}); // test eax, eax; setne al
+        emit({0x85, 0xD2, 0x0F, 0x95, 0xC2}); // test edx, edx; setne dl
+        emit({0x0F, 0xB6, 0xC0, 0x0F, 0xB6, 0xD2, op, 0xD0});
+    }
+
+    // eax = eax / edx, leaves the remainder in edx. division by zero and INT_MIN / -1
+    // fault, so those go back to the interpreter, which fails the way it always has
+    void divide(size_t pc)
+    {
+        emit({0x85, 0xD2});                   // test edx, edx
+        bail_to({0x0F, 0x84}, pc);            // jz
+        emit({0x83, 0xFA, 0xFF});             // cmp edx, -1
+        emit({0x75, 11});                     // jne over the next two instructions
+        emit({0x3D});                         // cmp eax, INT_MIN
+        imm32(INT_MIN);
+        bail_to({0x0F, 0x84}, pc);            // je
+        emit({0x41, 0x89, 0xD0});             // mov r8d, edx
+        emit({0x99, 0x41, 0xF7, 0xF8});       // cdq; idiv r8d
+    }
+
+    // compares the top slot against k and jumps to target unless it holds,
+    // jcc is the negated condition
+    void compare_const_branch(int k, bool pop, unsigned char jcc, size_t target, size_t pc)
+    {
+        top_slot();
+        expect_int(rcx, top, pc);
+        load_int(rax, rcx, top);
+        if (pop)
+            drop();
+        emit({0x3D});
+        imm32(k);
+        jump_to({0x0F, jcc}, target);
+    }
+};
+
+// the generic form of an instruction, the JIT doesn't care which types the interpreter last saw
+OpCode generic(OpCode op)
+{
+    switch (op)
+    {
+    case op_add_int:
+        return op_add;
+    case op_sub_int:
+        return op_sub;
+    case op_mul_int:
+        return op_mul;
+    case op_lt_int:
+        return op_lt;
+    case op_gt_int:
+        return op_gt;
+    case op_eq_int:
+        return op_eq;
+    case op_add_const_int:
+        return op_add_const;
+    case op_sub_const_int:
+        return op_sub_const;
+    case op_load_var:
+        return op_identifier;
+    case op_jit_loop:
+        return op_jump; // an inner loop that has been compiled on its own
+    default:
+        return op;
+    }
+}
+
+} // namespace
+
+int Jit::compile(const Program &program, size_t head, size_t back_edge, const std::vector<int> &functions)
+{
+    static_assert(offsetof(Value, type) == value_type && offsetof(Value, heap) == value_heap &&
+                      offsetof(Value, val_int) == value_int && sizeof(Value) == value_size,
+                  "generated code assumes this Value layout");
+    static_assert(offsetof(JitState, stack) == 0 && offsetof(JitState, depth) == 8 &&
+                      offsetof(JitState, limit) == 16 && offsetof(JitState, variables) == 24 &&
+                      offsetof(JitState, locals) == 32,
+                  "generated code assumes this JitState layout");
+
+    Loop loop;
+    loop.exit = back_edge + 1;
+
+    // everything in the loop must be supported and every jump must stay inside it
+    for (size_t pc = head; pc <= back_edge; pc++)
+    {
+        const Instr &instr = program.code[pc];
+        switch (generic(instr.op))
+        {
+        case op_push_int:
+        case op_var:
+        case op_load_local:
+        case op_store_local:
+        case op_dup:
+        case op_swap:
+        case op_over:
+        case op_twodup:
+        case op_pop:
+        case op_add:
+        case op_sub:
+        case op_mul:
+        case op_div:
+        case op_mod:
+        case op_lt:
+        case op_gt:
+        case op_eq:
+        case op_and:
+        case op_or:
+        case op_not:
+        case op_add_const:
+        case op_sub_const:
+        case op_mul_locals:
+        case op_check_depth:
+            break;
+        case op_identifier:
+            // calls stay in the interpreter
+            if (functions[instr.operand] >= 0)
+                return -1;
+            loop.variables.push_back(instr.operand);
+            break;
+        case op_jump:
+        case op_jump_if_false:
+            if ((size_t)instr.operand < head || (size_t)instr.operand > loop.exit)
+                return -1;
+            break;
+        case op_eq_const_branch:
+        case op_lt_const_branch:
+        case op_gt_const_branch:
+        case op_dup_eq_const_branch:
+        case op_dup_lt_const_branch:
+        case op_dup_gt_const_branch:
+            if ((size_t)instr.operand2 < head || (size_t)instr.operand2 > loop.exit)
+                return -1;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    Assembler a;
+
+    // push rbx, rbp, r12-r15; mov rbp, rdi
+    a.emit({0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, 0x48, 0x89, 0xFD});
+    a.emit({0x48, 0x8B, 0x5D, 0x00});                   // mov rbx, [rbp + stack]
+    a.emit({0x4C, 0x8B, 0x65, 0x08, 0x49, 0xC1, 0xE4, 0x04}); // mov r12, [rbp + depth]; shl r12, 4
+    a.emit({0x4C, 0x8B, 0x6D, 0x10, 0x49, 0xC1, 0xE5, 0x04}); // mov r13, [rbp + limit]; shl r13, 4
+    a.emit({0x4C, 0x8B, 0x75, 0x18});                   // mov r14, [rbp + variables]
+    a.emit({0x4C, 0x8B, 0x7D, 0x20});                   // mov r15, [rbp + locals]
+
+    // native offset of every instruction in the loop, the prologue falls into the head
+    std::vector<size_t> labels(loop.exit - head);
+
+    for (size_t pc = head; pc <= back_edge; pc++)
+    {
+        const Instr &instr = program.code[pc];
+        labels[pc - head] = a.buf.size();
+
+        // every template checks everything it needs before it changes anything,
+        // so bailing out at pc leaves the state the interpreter expects there
+        switch (generic(instr.op))
+        {
+        case op_push_int:
+            a.need_slots(1, pc);
+            a.top_slot();
+            a.int_header(rcx, 0);
+            a.emit({0xC7, 0x41, (unsigned char)value_int}); // mov dword [rcx + value_int], K
+            a.imm32(instr.operand);
+            a.emit({0x49, 0x83, 0xC4, (unsigned char)value_size});
+            break;
+        case op_identifier:
+        case op_load_local:
+            a.need_slots(1, pc);
+            if (instr.op != op_load_local)
+                a.variable_slot(instr.operand);
+            else
+                a.local_slot(instr.operand);
+            a.expect_int(rdx, 0, pc); // a missing variable is an error for the interpreter to report
+            a.load_int(rax, rdx, 0);
+            a.top_slot();
+            a.push_eax();
+            break;
+        case op_var:
+        case op_store_local:
+            a.top_slot();
+            a.expect_int(rcx, top, pc);
+            if (instr.op == op_var)
+                a.variable_slot(instr.operand);
+            else
+                a.local_slot(instr.operand);
+            // overwriting a long string would leak it
+            a.emit({0x80, 0x7A, (unsigned char)value_heap, 0x00}); // cmp byte [rdx + value_heap], 0
+            a.bail_to({0x0F, 0x85}, pc);
+            a.load_int(rax, rcx, top);
+            a.int_header(rdx, 0);
+            a.store_int(rax, rdx, 0);
+            a.drop();
+            break;
+        case op_dup:
+            a.need_slots(1, pc);
+            a.top_slot();
+            a.expect_int(rcx, top, pc);
+            a.load_int(rax, rcx, top);
+            a.push_eax();
+            break;
+        case op_over:
+            a.need_slots(1, pc);
+            a.top_slot();
+            a.expect_int(rcx, third, pc);
+            a.load_int(rax, rcx, third);
+            a.push_eax();
+            break;
+        case op_twodup:
+            a.need_slots(2, pc);
+            a.top_slot();
+            a.expect_int(rcx, second, pc);
+            a.expect_int(rcx, top, pc);
+            a.load_int(rax, rcx, second);
+            a.load_int(rdx, rcx, top);
+            a.int_header(rcx, 0);
+            a.store_int(rax, rcx, 0);
+            a.int_header(rcx, value_size);
+            a.store_int(rdx, rcx, value_size);
+            a.emit({0x49, 0x83, 0xC4, (unsigned char)(2 * value_size)});
+            break;
+        case op_swap:
+            a.int_operands(pc);
+            a.store_int(rdx, rcx, second);
+            a.store_int(rax, rcx, top);
+            break;
+        case op_pop:
+            a.top_slot();
+            a.expect_int(rcx, top, pc); // strings need their destructor
+            a.drop();
+            break;
+        case op_add:
+            a.int_operands(pc);
+            a.emit({0x01, 0xD0}); // add eax, edx
+            a.binary_result();
+            break;
+        case op_sub:
+            a.int_operands(pc);
+            a.emit({0x29, 0xD0}); // sub eax, edx
+            a.binary_result();
+            break;
+        case op_mul:
+            a.int_operands(pc);
+            a.emit({0x0F, 0xAF, 0xC2}); // imul eax, edx
+            a.binary_result();
+            break;
+        case op_div:
+            a.int_operands(pc);
+            a.divide(pc);
+            a.binary_result();
+            break;
+        case op_mod:
+            a.int_operands(pc);
+            a.divide(pc);
+            a.emit({0x89, 0xD0}); // mov eax, edx
+            a.binary_result();
+            break;
+        case op_lt:
+            a.int_operands(pc);
+            a.compare(0x9C); // setl
+            a.binary_result();
+            break;
+        case op_gt:
+            a.int_operands(pc);
+            a.compare(0x9F); // setg
+            a.binary_result();
+            break;
+        case op_eq:
+            a.int_operands(pc);
+            a.compare(0x94); // sete
+            a.binary_result();
+            break;
+        case op_and:
+            a.int_operands(pc);
+            a.logical(0x21); // and eax, edx
+            a.binary_result();
+            break;
+        case op_or:
+            a.int_operands(pc);
+            a.logical(0x09); // or eax, edx
+            a.binary_result();
+            break;
+        case op_not:
+            a.top_slot();
+            a.expect_int(rcx, top, pc);
+            a.emit({0x83, 0x79, (unsigned char)(top + value_int), 0x00}); // cmp dword [rcx + top], 0
+            a.emit({0x0F, 0x94, 0xC0, 0x0F, 0xB6, 0xC0});                 // sete al; movzx eax, al
+            a.store_int(rax, rcx, top);
+            break;
+        case op_add_const:
+        case op_sub_const:
+            a.top_slot();
+            a.expect_int(rcx, top, pc);
+            // add/sub dword [rcx + top], K
+            a.emit({0x81, (unsigned char)(generic(instr.op) == op_add_const ? 0x41 : 0x69), (unsigned char)(top + value_int)});
+            a.imm32(instr.operand);
+            break;
+        case op_mul_locals:
+            a.need_slots(1, pc);
+            a.local_slot(instr.operand);
+            a.expect_int(rdx, 0, pc);
+            a.load_int(rax, rdx, 0);
+            a.local_slot(instr.operand2);
+            a.expect_int(rdx, 0, pc);
+            a.emit({0x0F, 0xAF, 0x42, (unsigned char)value_int}); // imul eax, [rdx + value_int]
+            a.top_slot();
+            a.push_eax();
+            break;
+        case op_check_depth:
+            // cmp r12, depth * 16; jb. the interpreter reports the error
+            a.emit({0x49, 0x81, 0xFC});
+            a.imm32(instr.operand * value_size);
+            a.bail_to({0x0F, 0x82}, pc);
+            break;
+        case op_jump:
+            a.jump_to({0xE9}, instr.operand);
+            break;
+        case op_jump_if_false:
+            a.top_slot();
+            a.expect_int(rcx, top, pc);
+            a.load_int(rax, rcx, top);
+            a.drop();
+            a.emit({0x85, 0xC0});                    // test eax, eax
+            a.jump_to({0x0F, 0x8E}, instr.operand);  // jle
+            break;
+        case op_eq_const_branch:
+            a.compare_const_branch(instr.operand, true, 0x85, instr.operand2, pc); // jne
+            break;
+        case op_lt_const_branch:
+            a.compare_const_branch(instr.operand, true, 0x8D, instr.operand2, pc); // jge
+            break;
+        case op_gt_const_branch:
+            a.compare_const_branch(instr.operand, true, 0x8E, instr.operand2, pc); // jle
+            break;
+        case op_dup_eq_const_branch:
+            a.compare_const_branch(instr.operand, false, 0x85, instr.operand2, pc);
+            break;
+        case op_dup_lt_const_branch:
+            a.compare_const_branch(instr.operand, false, 0x8D, instr.operand2, pc);
+            break;
+        case op_dup_gt_const_branch:
+            a.compare_const_branch(instr.operand, false, 0x8E, instr.operand2, pc);
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    // leaving the loop is a bail out to the instruction after it
+    for (const std::pair<size_t, size_t> &jump : a.jumps)
+    {
+        if (jump.second == loop.exit)
+            a.bails.push_back(jump);
+        else
+            a.patch(jump.first, labels[jump.second - head]);
+    }
+
+    // eax holds the pc to continue at: store the depth back, restore registers
+    size_t epilogue = a.buf.size();
+    a.emit({0x49, 0xC1, 0xEC, 0x04, 0x4C, 0x89, 0x65, 0x08}); // shr r12, 4; mov [rbp + depth], r12
+    a.emit({0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, 0xC3});
+
+    // one stub per pc that can bail out: mov eax, pc; jmp epilogue
+    std::vector<size_t> stubs(loop.exit - head + 1, 0);
+    for (const std::pair<size_t, size_t> &bail : a.bails)
+    {
+        size_t &stub = stubs[bail.second - head];
+        if (!stub)
+        {
+            stub = a.buf.size();
+            a.emit({0xB8});
+            a.imm32((int32_t)bail.second);
+            a.emit({0xE9});
+            a.imm32(0);
+            a.patch(a.buf.size() - 4, epilogue);
+        }
+        a.patch(bail.first, stub);
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    loop.mapping_len = (a.buf.size() + page - 1) / page * page;
+    loop.mapping = mmap(nullptr, loop.mapping_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (loop.mapping == MAP_FAILED)
+        return -1;
+    memcpy(loop.mapping, a.buf.data(), a.buf.size());
+    if (mprotect(loop.mapping, loop.mapping_len, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(loop.mapping, loop.mapping_len);
+        return -1;
+    }
+    loop.entry = (size_t (*)(JitState *))loop.mapping;
+
+    loops.push_back(std::move(loop));
+    return (int)loops.size() - 1;
+}
+
+#endif
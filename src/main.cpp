@@ -1,17 +1,61 @@
 #include "source_code.hpp"
 #include "type.hpp"
 #include "parser.hpp"
+#include "mapped_file.hpp"
+#include "profiler.hpp"
 
-int main()
+#include <cstring>
+
+int main(int argc, char **argv)
 {
-    std::ifstream t("../example.txt");
+    // pringlelang [--profile] [file], "-" reads the script from stdin
+    bool profile = false;
+    const char *path = "../example.txt";
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--profile"))
+            profile = true;
+        else
+            path = argv[i];
+    }
+    bool is_stdin = !strcmp(path, "-");
 
-    std::string raw_src((std::istreambuf_iterator<char>(t)),
-                        std::istreambuf_iterator<char>());
-    SourceCode src = SourceCode(raw_src);
+    MappedFile file;
+    if (!file.open(path))
+    {
+        std::cout << "Error: could not read \"" << path << "\".\n";
+        return 1;
+    }
+    SourceCode src = SourceCode::from_view(file.data(), file.size());
 
     Parser parser;
-    parser.parse(src);
+    Profiler profiler;
+    if (profile)
+    {
+        if (!profiler.start())
+            std::cerr << "Error: could not start the profiler.\n";
+        parser.set_profiler(&profiler);
+    }
+
+    // scripts from files keep their compiled form next to them in <file>.pbc
+    int status = is_stdin ? parser.parse(src) : parser.parse_cached(src, std::string(path) + ".pbc");
 
-    t.close();
+    // reports are written next to the script
+    std::string base = is_stdin ? "stdin" : path;
+    if (profile)
+    {
+        // <file>.prof is the flat profile, <file>.folded the stacks for flamegraph tools
+        profiler.stop();
+        std::ofstream flat(base + ".prof");
+        std::ofstream collapsed(base + ".folded");
+        profiler.write_flat(flat, parser.get_program());
+        profiler.write_collapsed(collapsed, parser.get_program());
+        std::cerr << "profile: " << profiler.sample_count() << " samples written to " << base << ".prof and " << base
+                  << ".folded\n";
+    }
+#ifdef PRINGLE_OPCODE_STATS
+    std::ofstream json(base + ".opstats.json");
+    parser.get_stats().write_json(json);
+#endif
+    return status == 1 ? 1 : 0;
 }
@@ -0,0 +1,52 @@
+#include "mapped_file.hpp"
+
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool MappedFile::open(const char *path)
+{
+    close();
+
+    bool is_stdin = !strcmp(path, "-");
+    int fd = is_stdin ? STDIN_FILENO : ::open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            mapping = (const char *)p;
+            mapping_len = st.st_size;
+            if (!is_stdin)
+                ::close(fd);
+            return true;
+        }
+    }
+
+    // streaming fallback
+    char chunk[1 << 16];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+    {
+        buffer.append(chunk, n);
+    }
+    if (!is_stdin)
+        ::close(fd);
+    return n == 0;
+}
+
+void MappedFile::close()
+{
+    if (mapping)
+        munmap((void *)mapping, mapping_len);
+    mapping = nullptr;
+    mapping_len = 0;
+    buffer.clear();
+}
@@ -0,0 +1,69 @@
+#include "opcode_stats.hpp"
+
+#ifdef PRINGLE_OPCODE_STATS
+
+#include <chrono>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// in OpCode order
+static const char *const opcode_names[] = {
+    "push_int", "push_str", "print", "flush", "func", "var", "identifier", "load_local", "store_local",
+    "jump", "jump_if_false", "break", "return",
+    "dup", "swap", "over", "twodup", "pop",
+    "index", "add", "sub", "mul", "div", "mod", "pow", "lt", "gt", "eq", "and", "or", "not",
+    "add_const", "sub_const", "eq_const_branch", "lt_const_branch", "gt_const_branch",
+    "dup_eq_const_branch", "dup_lt_const_branch", "dup_gt_const_branch", "mul_locals",
+    "check_depth",
+    "add_int", "add_str", "sub_int", "mul_int", "lt_int", "gt_int", "eq_int", "add_const_int", "sub_const_int",
+    "call", "load_var",
+    "jit_loop",
+};
+static_assert(sizeof(opcode_names) / sizeof(opcode_names[0]) == op_count, "opcode_names is out of sync with OpCode");
+
+uint64_t OpcodeStats::now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+const char *OpcodeStats::clock_name()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return "tsc";
+#else
+    return "ns";
+#endif
+}
+
+void OpcodeStats::write_json(std::ostream &os) const
+{
+    os << "{\n  \"clock\": \"" << clock_name() << "\",\n";
+    os << "  \"calls\": " << calls << ",\n";
+    os << "  \"loop_iterations\": " << loop_iterations << ",\n";
+    os << "  \"opcodes\": {";
+    bool first = true;
+    for (int op = 0; op < op_count; op++)
+    {
+        if (!counts[op])
+            continue;
+        // histogram up to its last non-empty bucket
+        int used = buckets;
+        while (used > 0 && !histogram[op][used - 1])
+            used--;
+        os << (first ? "\n" : ",\n") << "    \"" << opcode_names[op] << "\": {\"count\": " << counts[op] << ", \"histogram\": [";
+        for (int b = 0; b < used; b++)
+        {
+            os << (b ? ", " : "") << histogram[op][b];
+        }
+        os << "]}";
+        first = false;
+    }
+    os << "\n  }\n}\n";
+}
+
+#endif
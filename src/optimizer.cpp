@@ -0,0 +1,355 @@
+#include "parser.hpp"
+
+static bool is_branch(OpCode op)
+{
+    return op >= op_eq_const_branch && op <= op_dup_gt_const_branch;
+}
+
+// evaluates an int binary operator the same way Parser::run does, returns false if
+// the result shouldn't be computed at load time (division by zero, overflow)
+static bool fold_binary(OpCode op, int x, int y, int &result)
+{
+    long long r;
+    switch (op)
+    {
+    case op_add: r = (long long)x + y; break;
+    case op_sub: r = (long long)x - y; break;
+    case op_mul: r = (long long)x * y; break;
+    case op_div:
+        if (y == 0 || (x == INT_MIN && y == -1))
+            return false;
+        r = x / y;
+        break;
+    case op_mod:
+        if (y == 0 || (x == INT_MIN && y == -1))
+            return false;
+        r = x % y;
+        break;
+    case op_pow:
+    {
+        double p = pow(x, y);
+        if (p < INT_MIN || p > INT_MAX)
+            return false;
+        r = (int)p;
+    }
+    break;
+    case op_lt: r = x < y; break;
+    case op_gt: r = x > y; break;
+    case op_eq: r = x == y; break;
+    case op_and: r = x && y; break;
+    case op_or: r = x || y; break;
+    default:
+        return false;
+    }
+    if (r < INT_MIN || r > INT_MAX)
+        return false;
+    result = r;
+    return true;
+}
+
+void Parser::optimize(size_t start)
+{
+    std::vector<Instr> &code = program.code;
+    size_t end = code.size();
+
+    // nothing may be folded or fused into the instruction before a jump target or function entry
+    std::vector<bool> is_target(end + 1, false);
+    for (size_t i = start; i < end; i++)
+    {
+        if (code[i].op == op_jump || code[i].op == op_jump_if_false)
+            is_target[code[i].operand] = true;
+    }
+    for (const FuncDef &func : program.funcs)
+    {
+        if (func.entry >= start)
+            is_target[func.entry] = true;
+    }
+
+    // rewrites in place: out is the end of the fused code, new_index maps old positions to new ones
+    // and target_at marks the fused positions that something jumps to
+    std::vector<size_t> new_index(end + 1, 0);
+    std::vector<bool> target_at(end, false);
+    size_t out = start;
+    size_t skip_to = 0; // set when an if block turns out to be dead
+    // a jump target that was removed, whatever gets fused into its position next inherits the mark
+    bool pending_target = false;
+    for (size_t i = start; i < end; i++)
+    {
+        if (i < skip_to)
+        {
+            // nothing outside of a block jumps into it
+            new_index[i] = out;
+            continue;
+        }
+        new_index[i] = out;
+        target_at[out] = is_target[i] || pending_target;
+        pending_target = false;
+        code[out++] = code[i];
+
+        // each pattern is matched against the tail of the fused code, so fusions can build on each other.
+        // len is how many of the (at most 3) last instructions can be fused, i.e. none but the first is a jump target
+        bool fused = true;
+        while (fused)
+        {
+            fused = false;
+            Instr *tail = &code[out - 1];
+            size_t len = 1;
+            while (len < 3 && out - len > start && !target_at[out - len])
+                len++;
+
+            int folded;
+
+            // constant folding: literal operands make a literal, e.g. 0 N - is the literal -N
+            if (len >= 3 && tail[-1].op == op_push_int && tail[-2].op == op_push_int &&
+                fold_binary(tail[0].op, tail[-2].operand, tail[-1].operand, folded))
+            {
+                tail[-2].operand = folded;
+                out -= 2;
+                fused = true;
+            }
+            else if (len >= 2 && tail[0].op == op_not && tail[-1].op == op_push_int)
+            {
+                tail[-1].operand = !tail[-1].operand;
+                out -= 1;
+                fused = true;
+            }
+            // if on a literal: always true runs the body as straight line code, otherwise the body is dropped
+            else if (len >= 2 && tail[0].op == op_jump_if_false && tail[-1].op == op_push_int)
+            {
+                if (tail[-1].operand <= 0)
+                    skip_to = tail[0].operand;
+                out -= 2;
+                // the push_int may be a loop head, jumps to it now land on what comes next
+                pending_target = target_at[out];
+            }
+            // superinstructions
+            else if (len >= 2 && tail[-1].op == op_push_int && (tail[0].op == op_add || tail[0].op == op_sub))
+            {
+                tail[-1].op = tail[0].op == op_add ? op_add_const : op_sub_const;
+                out -= 1;
+                fused = true;
+            }
+            else if (len >= 3 && tail[0].op == op_jump_if_false && tail[-2].op == op_push_int &&
+                     (tail[-1].op == op_eq || tail[-1].op == op_lt || tail[-1].op == op_gt))
+            {
+                tail[-2].op = tail[-1].op == op_eq ? op_eq_const_branch : tail[-1].op == op_lt ? op_lt_const_branch : op_gt_const_branch;
+                tail[-2].operand2 = tail[0].operand;
+                out -= 2;
+                fused = true;
+            }
+            else if (len >= 2 && tail[-1].op == op_dup && (tail[0].op == op_eq_const_branch || tail[0].op == op_lt_const_branch ||
+                                                           tail[0].op == op_gt_const_branch))
+            {
+                tail[-1] = tail[0];
+                tail[-1].op = (OpCode)(tail[0].op - op_eq_const_branch + op_dup_eq_const_branch);
+                out -= 1;
+                fused = true;
+            }
+            else if (len >= 3 && tail[0].op == op_mul && tail[-1].op == op_load_local && tail[-2].op == op_load_local)
+            {
+                tail[-2].op = op_mul_locals;
+                tail[-2].operand2 = tail[-1].operand;
+                out -= 2;
+                fused = true;
+            }
+        }
+    }
+    new_index[end] = out;
+    code.resize(out);
+
+    for (size_t i = start; i < out; i++)
+    {
+        if (code[i].op == op_jump || code[i].op == op_jump_if_false)
+            code[i].operand = new_index[code[i].operand];
+        else if (is_branch(code[i].op))
+            code[i].operand2 = new_index[code[i].operand2];
+    }
+    for (FuncDef &func : program.funcs)
+    {
+        if (func.entry >= start)
+        {
+            func.entry = new_index[func.entry];
+            func.end = new_index[func.end];
+        }
+    }
+}
+
+void stack_effect(OpCode op, int &need, int &delta)
+{
+    need = 0;
+    delta = 0;
+    switch (op)
+    {
+    case op_push_int:
+    case op_push_str:
+    case op_load_local:
+    case op_mul_locals:
+        delta = 1;
+        break;
+    case op_print:
+    case op_var:
+    case op_store_local:
+    case op_jump_if_false:
+    case op_pop:
+    case op_eq_const_branch:
+    case op_lt_const_branch:
+    case op_gt_const_branch:
+        need = 1;
+        delta = -1;
+        break;
+    case op_not:
+    case op_add_const:
+    case op_sub_const:
+    case op_dup_eq_const_branch:
+    case op_dup_lt_const_branch:
+    case op_dup_gt_const_branch:
+        need = 1;
+        break;
+    case op_dup:
+        need = 1;
+        delta = 1;
+        break;
+    case op_swap:
+        need = 2;
+        break;
+    case op_twodup:
+        need = 2;
+        delta = 2;
+        break;
+    case op_over:
+        need = 3;
+        delta = 1;
+        break;
+    case op_index:
+    case op_add:
+    case op_sub:
+    case op_mul:
+    case op_div:
+    case op_mod:
+    case op_pow:
+    case op_lt:
+    case op_gt:
+    case op_eq:
+    case op_and:
+    case op_or:
+        need = 2;
+        delta = -1;
+        break;
+    default: // no stack effect, or handled by the caller (op_identifier)
+        break;
+    }
+}
+
+int successors(const std::vector<Instr> &code, size_t i, size_t next[2])
+{
+    const Instr &instr = code[i];
+    switch (instr.op)
+    {
+    case op_jump:
+        next[0] = instr.operand;
+        return 1;
+    case op_jump_if_false:
+        next[0] = i + 1;
+        next[1] = instr.operand;
+        return 2;
+    case op_eq_const_branch:
+    case op_lt_const_branch:
+    case op_gt_const_branch:
+    case op_dup_eq_const_branch:
+    case op_dup_lt_const_branch:
+    case op_dup_gt_const_branch:
+        next[0] = i + 1;
+        next[1] = instr.operand2;
+        return 2;
+    case op_break:
+    case op_return:
+        return 0;
+    default:
+        next[0] = i + 1;
+        return 1;
+    }
+}
+
+void Parser::insert_stack_checks(size_t start)
+{
+    std::vector<Instr> &code = program.code;
+    size_t end = code.size();
+    const int unvisited = INT_MAX;
+
+    // depth[i] is a proven lower bound of the stack depth before code[i] runs.
+    // the program and every function body start with nothing known (0).
+    // after an instruction ran, its need is met, so the bound afterwards is max(depth, need) + delta
+    std::vector<int> depth(end - start, unvisited);
+    std::vector<size_t> worklist;
+    depth[0] = 0;
+    worklist.push_back(start);
+    for (const FuncDef &func : program.funcs)
+    {
+        if (func.entry >= start)
+        {
+            depth[func.entry - start] = 0;
+            worklist.push_back(func.entry);
+        }
+    }
+
+    while (!worklist.empty())
+    {
+        size_t i = worklist.back();
+        worklist.pop_back();
+        const Instr &instr = code[i];
+
+        int need, delta;
+        stack_effect(instr.op, need, delta);
+        int after = std::max(depth[i - start], need) + delta;
+        if (instr.op == op_identifier)
+            after = 0; // a function call can leave any depth behind
+
+        size_t next[2];
+        int n = successors(code, i, next);
+
+        // the bound at a join is the smallest of its predecessors', it only ever goes down so this terminates
+        for (int k = 0; k < n; k++)
+        {
+            int &d = depth[next[k] - start];
+            if (d == unvisited || after < d)
+            {
+                d = after;
+                worklist.push_back(next[k]);
+            }
+        }
+    }
+
+    // insert the guards, new_index maps old positions to new ones (a guarded instruction maps to its guard)
+    std::vector<Instr> checked;
+    std::vector<size_t> new_index(end - start + 1);
+    checked.reserve(end - start);
+    for (size_t i = start; i < end; i++)
+    {
+        int need, delta;
+        stack_effect(code[i].op, need, delta);
+        new_index[i - start] = start + checked.size();
+        if (depth[i - start] != unvisited && depth[i - start] < need)
+            checked.push_back({op_check_depth, need, code[i].op, code[i].line});
+        checked.push_back(code[i]);
+    }
+    new_index[end - start] = start + checked.size();
+
+    for (Instr &instr : checked)
+    {
+        if (instr.op == op_jump || instr.op == op_jump_if_false)
+            instr.operand = new_index[instr.operand - start];
+        else if (is_branch(instr.op))
+            instr.operand2 = new_index[instr.operand2 - start];
+    }
+    for (FuncDef &func : program.funcs)
+    {
+        if (func.entry >= start)
+        {
+            func.entry = new_index[func.entry - start];
+            func.end = new_index[func.end - start];
+        }
+    }
+
+    code.resize(start);
+    code.insert(code.end(), checked.begin(), checked.end());
+}
@@ -0,0 +1,85 @@
+#include "output.hpp"
+
+void Output::drain()
+{
+    size_t len = pptr() - pbase();
+    if (len == 0)
+        return;
+
+    if (sink)
+    {
+        sink->append(pbase(), len);
+    }
+    else
+    {
+        const char *p = pbase();
+        while (len > 0)
+        {
+            ssize_t n = ::write(fd, p, len);
+            if (n < 0)
+                break; // nowhere to report it, drop the output
+            p += n;
+            len -= n;
+        }
+    }
+    setp(buf.data(), buf.data() + buf.size());
+}
+
+int Output::overflow(int c)
+{
+    drain();
+    if (c != EOF)
+    {
+        *pptr() = c;
+        pbump(1);
+    }
+    return 0;
+}
+
+std::streamsize Output::xsputn(const char *s, std::streamsize n)
+{
+    if ((size_t)n > (size_t)(epptr() - pptr()))
+    {
+        drain();
+        if ((size_t)n >= capacity)
+        {
+            // too big to be worth buffering, hand it over in one go
+            setp(const_cast<char *>(s), const_cast<char *>(s) + n);
+            pbump(n);
+            drain();
+            return n;
+        }
+    }
+    memcpy(pptr(), s, n);
+    pbump(n);
+    return n;
+}
+
+int Output::sync()
+{
+    drain();
+    return 0;
+}
+
+void Output::write(const Value &v)
+{
+    if (v.get_type() == type_string)
+    {
+        sputn(v.string_data(), v.string_size());
+        return;
+    }
+
+    int i = v.get_int();
+    char digits[12];
+    char *end = digits + sizeof(digits);
+    char *p = end;
+    unsigned int u = i < 0 ? 0u - (unsigned int)i : i;
+    do
+    {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (i < 0)
+        *--p = '-';
+    sputn(p, end - p);
+}
@@ -1,389 +1,491 @@
 #include "parser.hpp"
+#include "bytecode_cache.hpp"
+
+#include <cstring>
+
+namespace
+{
+
+struct Keyword
+{
+    const char *name;
+    size_t len;
+    Token token;
+};
+
+// perfect hash of the keywords, no two of them land in the same slot
+constexpr size_t keyword_slot(char first, size_t len)
+{
+    return (2 * (unsigned char)first + len) % 16;
+}
+
+constexpr Keyword keywords[16] = {
+    {"func", 4, tok_func},     {"flush", 5, tok_flush},   {"over", 4, tok_over},  {"pop", 3, tok_pop},
+    {"if", 2, tok_if},         {"print", 5, tok_print},   {"", 0, tok_identifier}, {"", 0, tok_identifier},
+    {"", 0, tok_identifier},   {"break", 5, tok_break},   {"swap", 4, tok_swap},  {"dup", 3, tok_dup},
+    {"loop", 4, tok_loop},     {"", 0, tok_identifier},   {"twodup", 6, tok_twodup}, {"var", 3, tok_var},
+};
+
+constexpr bool keywords_in_their_slots(size_t i = 0)
+{
+    return i == 16 || ((keywords[i].len == 0 || keyword_slot(keywords[i].name[0], keywords[i].len) == i) &&
+                       keywords_in_their_slots(i + 1));
+}
+static_assert(keywords_in_their_slots(), "a keyword is not in the slot keyword_slot gives it, "
+                                         "move it or change the hash if two collide");
+
+Token keyword_token(const char *name, size_t len)
+{
+    const Keyword &keyword = keywords[keyword_slot(name[0], len)];
+    return keyword.len == len && memcmp(keyword.name, name, len) == 0 ? keyword.token : tok_identifier;
+}
+
+// op_push_int marks characters that aren't operators
+constexpr OpCode operator_op(int c)
+{
+    return c == '.' ? op_index
+         : c == '+' ? op_add
+         : c == '-' ? op_sub
+         : c == '*' ? op_mul
+         : c == '/' ? op_div
+         : c == '%' ? op_mod
+         : c == '^' ? op_pow
+         : c == '<' ? op_lt
+         : c == '>' ? op_gt
+         : c == '=' ? op_eq
+         : c == '&' ? op_and
+         : c == '|' ? op_or
+         : c == '!' ? op_not
+         : op_push_int;
+}
+
+#define OPERATORS_4(c) operator_op(c), operator_op(c + 1), operator_op(c + 2), operator_op(c + 3)
+#define OPERATORS_16(c) OPERATORS_4(c), OPERATORS_4(c + 4), OPERATORS_4(c + 8), OPERATORS_4(c + 12)
+#define OPERATORS_64(c) OPERATORS_16(c), OPERATORS_16(c + 16), OPERATORS_16(c + 32), OPERATORS_16(c + 48)
+
+// instruction for each operator character, indexed by the character's token
+constexpr OpCode operator_ops[256] = {OPERATORS_64(0), OPERATORS_64(64), OPERATORS_64(128), OPERATORS_64(192)};
+
+#undef OPERATORS_4
+#undef OPERATORS_16
+#undef OPERATORS_64
+
+} // namespace
 
 int Parser::gettok(SourceCode &src)
 {
-    int last_char = ' ';
+    // scans the raw buffer in place, tokens are spans into it and nothing is allocated per token
+    const char *cur = src.cursor();
+    const char *end = src.end();
 
-    // Skip any whitespace.
-    while (isspace(last_char))
+    // Skip any whitespace and comments.
+    while (cur != end)
     {
-        last_char = src.get_char();
-    }
-
-    if (isalpha(last_char)) // function names can currently be anything; make it so it can only be alphanumeric
-    {                       // identifier: [a-zA-Z][a-zA-Z0-9]*
-        identifier_str = last_char;
-        while (isalnum((last_char = src.get_char())))
+        if (isspace((unsigned char)*cur))
+        {
+            cur++;
+        }
+        else if (*cur == '#')
+        {
+            // Comment until end of line.
+            while (cur != end && *cur != '\n' && *cur != '\r')
+                cur++;
+        }
+        else
         {
-            identifier_str += last_char;
+            break;
         }
-        auto tok = command_to_token.find(identifier_str);
-        if (tok != command_to_token.end())
-            return tok->second;
-        return tok_identifier;
     }
 
-    if (isdigit(last_char))
+    // Check for end of file.
+    token_start = cur;
+    if (cur == end)
+    {
+        src.seek(cur);
+        return tok_eof;
+    }
+
+    const char *start = cur;
+    int token;
+    if (isalpha((unsigned char)*cur)) // function names can currently be anything; make it so it can only be alphanumeric
+    {                                 // identifier: [a-zA-Z][a-zA-Z0-9]*
+        while (++cur != end && isalnum((unsigned char)*cur))
+            ;
+        token = keyword_token(start, cur - start);
+        // reuses identifier_str's capacity, so this only allocates for the longest identifier seen so far
+        if (token == tok_identifier)
+            identifier_str.assign(start, cur - start);
+    }
+    else if (isdigit((unsigned char)*cur))
     { // Number: [0-9]+
-        std::string NumStr;
-        do
+        long long n = 0;
+        while (cur != end && isdigit((unsigned char)*cur))
         {
-            NumStr += last_char;
-            last_char = src.get_char();
-        } while (isdigit(last_char));
-
-        num_val = std::stoi(NumStr);
-        return tok_number;
+            n = n * 10 + (*cur++ - '0');
+            if (n > INT_MAX)
+                throw std::out_of_range("integer literal out of range");
+        }
+        num_val = n;
+        token = tok_number;
+    }
+    else if (*cur == '"')
+    {
+        str_start = ++cur;
+        while (cur != end && *cur != '"')
+            cur++;
+        str_len = cur - str_start;
+        if (cur != end)
+            cur++; // closing quote
+        token = tok_string;
+    }
+    else
+    {
+        // Otherwise, just return the character as its ascii value.
+        token = (unsigned char)*cur++;
     }
 
-    if (last_char == '"') {
-        std::string str;
-        last_char = src.get_char();
-        do
-        {
-            str += last_char;
-            last_char = src.get_char();
-        } while (last_char != '"');
+    src.seek(cur);
+    return token;
+}
 
-        str_val = str;
-        return tok_string;
-    }
+int Parser::add_string(const char *data, size_t len)
+{
+    auto it = program.string_ids.find({data, len});
+    if (it != program.string_ids.end())
+        return it->second;
+    ArenaString stored = {program.code_arena.copy(data, len), len};
+    program.strings.push_back(stored);
+    program.string_ids[stored] = program.strings.size() - 1;
+    return program.strings.size() - 1;
+}
 
-    if (last_char == '#')
-    {
-        // Comment until end of line.
-        do
-            last_char = src.get_char();
-        while (last_char != EOF && last_char != '\n' && last_char != '\r');
+int Parser::intern(const std::string &name)
+{
+    // probe with the lexer's buffer, only a new name gets copied into the arena
+    auto it = program.symbol_ids.find({name.data(), name.size()});
+    if (it != program.symbol_ids.end())
+        return it->second;
+    ArenaString stored = {program.arena.copy(name.data(), name.size()), name.size()};
+    program.symbols.push_back(stored);
+    program.symbol_ids[stored] = program.symbols.size() - 1;
+    return program.symbols.size() - 1;
+}
 
-        if (last_char != EOF)
-            return gettok(src);
+int Parser::source_line()
+{
+    while (line_scan < token_start)
+    {
+        if (*line_scan++ == '\n')
+            line++;
     }
+    return line;
+}
 
-    // Check for end of file.  Don't eat the EOF.
-    if (last_char == EOF)
-        return tok_eof;
-
-    // Otherwise, just return the character as its ascii value.
-    int this_char = last_char;
-    last_char = src.get_char();
-    return this_char;
+int Parser::local_slot(int symbol)
+{
+    if (arg_scope < 0)
+        return -1;
+    const FuncDef &func = program.funcs[arg_scope];
+    for (size_t i = 0; i < func.argc; i++)
+    {
+        if (func.arg_names[i] == symbol)
+            return i;
+    }
+    return -1;
 }
 
-int Parser::parse(SourceCode &src)
+int Parser::compile_block(SourceCode &src, bool nested, std::vector<size_t> *breaks)
 {
     int token = gettok(src);
-    while (token != -1)
+    while (token != tok_eof && !(nested && token == '}'))
     {
-        Value x, y, z;
-        // for functions/operators
-        std::vector<Value> args;
-        // for case tok_func
-        char c = ' ';
-        int b_count = 1; // unmatched bracket pair count
-        std::string name = "";
-        std::vector<std::string> arg_names;
-        std::string arg_name = "";
-        std::string inside_src = "";
-        // for case tok_loop
-        SourceCode new_src;
-        // TODO: throw if size of stack not ok for token type (unary op, binary op, etc) - ignore if function
         switch (token)
         {
         case tok_pop:
-            if (stack.empty())
-                throw std::logic_error("Cannot pop empty stack");
-            stack.pop();
+            emit(op_pop);
             break;
         case tok_dup:
-            stack.push(stack.top());
+            emit(op_dup);
             break;
         case tok_twodup:
-            x = stack.top();
-            stack.pop();
-            y = stack.top();
-            stack.push(x);
-            stack.push(y);
-            stack.push(x);
+            emit(op_twodup);
             break;
         case tok_swap:
-            x = stack.top();
-            stack.pop();
-            y = stack.top();
-            stack.pop();
-            stack.push(x);
-            stack.push(y);
+            emit(op_swap);
             break;
         case tok_over:
-            x = stack.top();
-            stack.pop();
-            y = stack.top();
-            stack.pop();
-            z = stack.top();
-            stack.push(y);
-            stack.push(x);
-            stack.push(z);
+            emit(op_over);
             break;
         case tok_print:
-            args.push_back(stack.top());
-            stack.pop();
-            std::cout << args[0];
+            emit(op_print);
+            break;
+        case tok_flush:
+            emit(op_flush);
             break;
         case tok_func:
-            c = src.get_char();
-            while (c != '{')
+        {
+            // func name arg1 arg2 ... argN { body }
+            // compiles to: op_func, op_jump past the body, body, op_return
+            FuncDef def;
+            if (gettok(src) != tok_identifier)
             {
-                if (c == ' ' && arg_name != "")
-                {
-                    if (name == "")
-                    {
-                        name = arg_name;
-                    }
-                    else
-                    {
-                        arg_names.push_back(arg_name);
-                    }
-                    arg_name = "";
-                }
-                else
-                {
-                    arg_name += c;
-                }
-                c = src.get_char();
+                diag << "Syntax Error: expected function name after \"func\".\n";
+                return -1;
             }
-
-            while (b_count != 0)
+            def.name = intern(identifier_str);
+            arg_buffer.clear();
+            while ((token = gettok(src)) == tok_identifier)
             {
-                c = src.get_char();
-
-                inside_src += c;
-                if (c == '{')
-                    b_count++;
-                if (c == '}')
-                    b_count--;
+                arg_buffer.push_back(intern(identifier_str));
             }
-            inside_src.pop_back();
-            functions[name] = std::move(SourceCode(inside_src, arg_names));
-            break;
+            def.arg_names = program.code_arena.copy(arg_buffer.data(), arg_buffer.size());
+            def.argc = arg_buffer.size();
+            if (token != '{')
+            {
+                diag << "Syntax Error: expected \"{\" after function arguments.\n";
+                return -1;
+            }
+            size_t func = program.funcs.size();
+            program.funcs.push_back(def);
+            emit(op_func, func);
+            size_t skip = program.code.size();
+            emit(op_jump);
+            program.funcs[func].entry = program.code.size();
+
+            // arguments are only visible inside this body, as slots of the call frame
+            int outer_scope = arg_scope;
+            arg_scope = func;
+            int status = compile_block(src, true, nullptr);
+            arg_scope = outer_scope;
+            if (status < 0)
+                return -1;
+            emit(op_return);
+            program.code[skip].operand = program.code.size();
+            program.funcs[func].end = program.code.size();
+        }
+        break;
         case tok_var:
             if (gettok(src) != tok_identifier)
             {
-                std::cout << "Name Error: invalid identifier name.\n";
-                return 1;
+                diag << "Name Error: invalid identifier name.\n";
+                return -1;
             }
-            args.push_back(stack.top());
-            stack.pop();
-            variables[identifier_str] = args[0];
-            break;
+        {
+            int symbol = intern(identifier_str);
+            int slot = local_slot(symbol);
+            if (slot >= 0)
+                emit(op_store_local, slot);
+            else
+                emit(op_var, symbol);
+        }
+        break;
         case tok_loop:
-            c = src.get_char();
-            while (b_count != 0)
+        {
+            // start: body, op_jump start; every break jumps past the back edge
+            if (gettok(src) != '{')
             {
-                c = src.get_char();
-
-                inside_src += c;
-                if (c == '{')
-                    b_count++;
-                if (c == '}')
-                    b_count--;
+                diag << "Syntax Error: expected \"{\" after \"loop\".\n";
+                return -1;
             }
-            inside_src.pop_back();
-
-            new_src = std::move(SourceCode(inside_src));
-            while (true)
+            size_t start = program.code.size();
+            std::vector<size_t> loop_breaks;
+            if (compile_block(src, true, &loop_breaks) < 0)
+                return -1;
+            emit(op_jump, start);
+            for (size_t b : loop_breaks)
             {
-                if (parse(new_src) != 0)
-                    break;
-
-                new_src.reset_idx();
+                program.code[b].operand = program.code.size();
             }
-            break;
-        case tok_break:
-            return 2;
-            break;
-        // TODO: refactor this for performance by jumping to closing bracket on false
-        //  instead of expensive recursive call to parse
+        }
+        break;
         case tok_if:
-            c = src.get_char();
-            while (b_count != 0)
+        {
+            // op_jump_if_false past the body, body
+            if (gettok(src) != '{')
             {
-                c = src.get_char();
-
-                inside_src += c;
-                if (c == '{')
-                    b_count++;
-                if (c == '}')
-                    b_count--;
+                diag << "Syntax Error: expected \"{\" after \"if\".\n";
+                return -1;
             }
-            inside_src.pop_back();
-            args.push_back(stack.top());
-            stack.pop();
-            if (args[0].get_int() > 0)
+            size_t jump = program.code.size();
+            emit(op_jump_if_false);
+            if (compile_block(src, true, breaks) < 0)
+                return -1;
+            program.code[jump].operand = program.code.size();
+        }
+        break;
+        case tok_break:
+            if (breaks)
             {
-                new_src = SourceCode(inside_src);
-                if (parse(new_src) != 0)
-                    return 2;
+                breaks->push_back(program.code.size());
+                emit(op_jump);
+            }
+            else
+            {
+                emit(op_break);
             }
             break;
         case tok_identifier:
         {
-            auto tok_func_id = functions.find(identifier_str);
-            auto tok_var_id = variables.find(identifier_str);
-            if (tok_func_id != functions.end())
-            { // if identifier_str is a key in functions
-                tok_func_id->second.reset_idx();
-
-                std::vector<std::string> str_args;
-                size_t s = tok_func_id->second.get_arg_names().size();
-                for (size_t i = 0; i < s; i++)
-                {
-                    str_args.push_back(tok_func_id->second.get_arg_names()[s - i - 1]);
-                    variables[tok_func_id->second.get_arg_names()[s - i - 1]] = stack.top();
-                    stack.pop();
-                }
-
-                parse(tok_func_id->second);
-
-                for (std::string str_arg : str_args) {
-                    variables.erase(variables.find(str_arg));
-                }
-            }
-            else if (tok_var_id != variables.end())
-            { // if identifier_str is a key in functions
-                stack.push(tok_var_id->second);
-            }
+            int symbol = intern(identifier_str);
+            int slot = local_slot(symbol);
+            if (slot >= 0)
+                emit(op_load_local, slot);
             else
-            {
-                std::cout << "Name Error: undeclared variable/function: \"" << identifier_str << "\".\n";
-                return 1;
-            }
+                emit(op_identifier, symbol);
         }
         break;
         case tok_number:
-            stack.push(num_val);
+            emit(op_push_int, num_val);
             break;
         case tok_string:
-            stack.push(str_val);
+            emit(op_push_str, add_string(str_start, str_len));
             break;
         default: // operator or unrecognized character
-            if (operators.find(token) == operators.end())
-            {
-                std::cout << "Syntax Error: unrecognized character: \"" << char(token) << "\".\n";
-                return 1;
-            }
-            if (stack.size() < 2 && token != '!')
-            {
-                std::cout << "Error: not enough operands in stack.\n";
-                return 1;
-            }
-            switch (token)
+        {
+            OpCode op = (unsigned)token < 256 ? operator_ops[token] : op_push_int;
+            if (op == op_push_int)
             {
-            case '.':
-                args.push_back(stack.top());
-                stack.pop();
-                args.push_back(stack.top());
-                stack.pop();
-                stack.push(Value(args[1].get_string()[args[0].get_int()]));
-                break;
-            case '+':
-                args.push_back(stack.top());
-                stack.pop();
-                args.push_back(stack.top());
-                stack.pop();
-                if (args[1].get_type() == type_int && args[0].get_type() == type_int)
-                {
-                    stack.push(Value(args[1].get_int() + args[0].get_int()));
-                }
-                else if (args[1].get_type() == type_string && args[0].get_type() == type_string)
-                {
-                    stack.push(Value(args[1].get_string() + args[0].get_string()));
-                }
-                else
-                {
-                    std::cout << "Argument Error: incorrect argument types (did not get two ints or two strings)!";
-                }
-                break;
-            case '*':
-                args.push_back(stack.top());
-                stack.pop();
-                args.push_back(stack.top());
-                stack.pop();
-                stack.push(Value(args[1].get_int() * args[0].get_int()));
-                break;
-            case '-':
-                args.push_back(stack.top());
-                stack.pop();
-                args.push_back(stack.top());
-                stack.pop();
-                stack.push(Value(args[1].get_int() - args[0].get_int()));
-                break;
-            case '/':
-                args.push_back(stack.top());
-                stack.pop();
-                args.push_back(stack.top());
-                stack.pop();
-                stack.push(Value(args[1].get_int() / args[0].get_int()));
-                break;
-            case '%':
-                args.push_back(stack.top());
-                stack.pop();
-                args.push_back(stack.top());
-                stack.pop();
-                stack.push(Value(args[1].get_int() % args[0].get_int()));
-                break;
-            case '^':
-                args.push_back(stack.top());
-                stack.pop();
-                args.push_back(stack.top());
-                stack.pop();
-                stack.push(Value((int)pow(args[1].get_int(), args[0].get_int()))); // coerce double to int by flooring
-                break;
-            case '<':
-                args.push_back(stack.top());
-                stack.pop();
-                args.push_back(stack.top());
-                stack.pop();
-                stack.push(Value(args[1].get_int() < args[0].get_int()));
-                break;
-            case '>':
-                args.push_back(stack.top());
-                stack.pop();
-                args.push_back(stack.top());
-                stack.pop();
-                stack.push(Value(args[1].get_int() > args[0].get_int()));
-                break;
-            case '=':
-                args.push_back(stack.top());
-                stack.pop();
-                args.push_back(stack.top());
-                stack.pop();
-                stack.push(Value(args[1].get_int() == args[0].get_int()));
-                break;
-            case '&':
-                args.push_back(stack.top());
-                stack.pop();
-                args.push_back(stack.top());
-                stack.pop();
-                stack.push(Value(args[1].get_int() && args[0].get_int()));
-                break;
-            case '|':
-                args.push_back(stack.top());
-                stack.pop();
-                args.push_back(stack.top());
-                stack.pop();
-                stack.push(Value(args[1].get_int() || args[0].get_int()));
-                break;
-            case '!':
-                if (stack.empty())
-                {
-                    std::cout << "Error: no operand in stack.\n";
-                    return 1;
-                }
-                stack.top() = !stack.top().get_int();
-                break;
+                diag << "Syntax Error: unrecognized character: \"" << char(token) << "\".\n";
+                return -1;
             }
+            emit(op);
+        }
         }
         token = gettok(src);
     }
+
+    if (nested && token == tok_eof)
+    {
+        diag << "Syntax Error: missing \"}\".\n";
+        return -1;
+    }
     return 0;
 }
+
+int Parser::compile(SourceCode &src)
+{
+    size_t entry = program.code.size();
+    size_t funcs = program.funcs.size();
+    arg_scope = -1;
+    token_start = line_scan = src.cursor();
+    line = 1;
+    // a failed compile drops the half compiled code and the functions defined in it,
+    // nothing can refer to them. the lexer throws on literals it can't represent
+    int status;
+    try
+    {
+        status = compile_block(src, false, nullptr);
+    }
+    catch (...)
+    {
+        program.code.resize(entry);
+        program.funcs.resize(funcs);
+        throw;
+    }
+    if (status < 0)
+    {
+        program.code.resize(entry);
+        program.funcs.resize(funcs);
+        return -1;
+    }
+    emit(op_return);
+    optimize(entry);
+    insert_stack_checks(entry);
+
+    functions.resize(program.symbols.size(), -1);
+    variables.resize(program.symbols.size());
+    return entry;
+}
+
+int Parser::parse(SourceCode &src)
+{
+    int entry = compile(src);
+    if (entry < 0)
+    {
+        out.flush();
+        return 1;
+    }
+    return execute(entry);
+}
+
+int Parser::parse_cached(SourceCode &src, const std::string &cache_file)
+{
+    // a cache file holds a whole program starting at pc 0
+    if (!program.code.empty())
+        return parse(src);
+
+    uint64_t hash = hash_source(src.data(), src.size());
+    if (load_program(cache_file, hash, program))
+    {
+        functions.resize(program.symbols.size(), -1);
+        variables.resize(program.symbols.size());
+        literals.clear();
+        return execute(0);
+    }
+
+    int entry = compile(src);
+    if (entry < 0)
+    {
+        out.flush();
+        return 1;
+    }
+    // before running, quickening rewrites the code in place
+    save_program(cache_file, program, hash);
+    return execute(entry);
+}
+
+void Parser::reset()
+{
+    // compiled code and string literals go, the symbol table and every buffer's capacity stay
+    program.code.clear();
+    program.funcs.clear();
+    program.strings.clear();
+    program.string_ids.clear();
+    program.code_arena.clear();
+    literals.clear();
+    jit.clear();
+
+    // snippets that keep using new names would grow it without bound
+    if (program.symbols.size() > reset_symbol_limit)
+    {
+        program.symbols.clear();
+        program.symbol_ids.clear();
+        program.arena.clear();
+        functions.clear();
+        variables.clear();
+    }
+
+    stack.clear();
+    functions.assign(functions.size(), -1);
+    variables.assign(variables.size(), Value());
+    names_epoch++;
+    frames.clear();
+    locals.clear();
+    frame_base = 0;
+}
+
+int Parser::execute(size_t entry)
+{
+    // a previous run that failed inside a function leaves its calls behind
+    frames.clear();
+    locals.clear();
+    frame_base = 0;
+    for (size_t i = literals.size(); i < program.strings.size(); i++)
+    {
+        literals.emplace_back(program.strings[i].data, program.strings[i].size);
+    }
+
+    int status;
+    try
+    {
+        status = run(entry);
+    }
+    catch (const std::invalid_argument &e)
+    {
+        // type errors from Value
+        diag << e.what() << "\n";
+        status = 1;
+    }
+    out.flush();
+    return status;
+}
@@ -0,0 +1,128 @@
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sys/time.h>
+
+volatile sig_atomic_t Profiler::pending = 0;
+
+static void on_tick(int)
+{
+    Profiler::pending = 1;
+}
+
+bool Profiler::start(long interval)
+{
+    if (running)
+        return true;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_tick;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &saved_action) != 0)
+        return false;
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = interval / 1000000;
+    timer.it_interval.tv_usec = interval % 1000000;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, nullptr) != 0)
+    {
+        sigaction(SIGPROF, &saved_action, nullptr);
+        return false;
+    }
+    interval_us = interval;
+    running = true;
+    return true;
+}
+
+void Profiler::stop()
+{
+    if (!running)
+        return;
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    sigaction(SIGPROF, &saved_action, nullptr);
+    pending = 0;
+    running = false;
+}
+
+std::string Profiler::function_at(const Program &program, size_t pc)
+{
+    // nested definitions give the innermost one, bodies dropped as dead code are empty
+    const FuncDef *best = nullptr;
+    size_t best_len = 0;
+    for (const FuncDef &func : program.funcs)
+    {
+        if (pc >= func.entry && pc < func.end && (!best || func.end - func.entry < best_len))
+        {
+            best = &func;
+            best_len = func.end - func.entry;
+        }
+    }
+    return best ? program.symbols[best->name].str() : "(top level)";
+}
+
+// sorted by count, most first, then by name
+static std::vector<std::pair<std::string, unsigned long>> by_count(const std::map<std::string, unsigned long> &counts)
+{
+    std::vector<std::pair<std::string, unsigned long>> sorted(counts.begin(), counts.end());
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [](const std::pair<std::string, unsigned long> &a, const std::pair<std::string, unsigned long> &b) {
+                         return a.second > b.second;
+                     });
+    return sorted;
+}
+
+void Profiler::write_flat(std::ostream &os, const Program &program) const
+{
+    std::map<std::string, unsigned long> functions;
+    std::map<std::string, unsigned long> lines;
+    for (const auto &sample : samples)
+    {
+        size_t pc = sample.first.back();
+        std::string name = function_at(program, pc);
+        functions[name] += sample.second;
+        lines[name + ":" + std::to_string(program.code[pc].line)] += sample.second;
+    }
+
+    char row[64];
+    os << "# " << total << " samples, one every " << interval_us << "us of CPU time\n";
+    os << "\n#  self%   samples  function\n";
+    for (const auto &entry : by_count(functions))
+    {
+        snprintf(row, sizeof(row), "%7.2f%% %9lu  ", 100.0 * entry.second / total, entry.second);
+        os << row << entry.first << "\n";
+    }
+    os << "\n#  self%   samples  function:line\n";
+    for (const auto &entry : by_count(lines))
+    {
+        snprintf(row, sizeof(row), "%7.2f%% %9lu  ", 100.0 * entry.second / total, entry.second);
+        os << row << entry.first << "\n";
+    }
+}
+
+void Profiler::write_collapsed(std::ostream &os, const Program &program) const
+{
+    // stacks that only differ in pcs within the same functions are merged
+    std::map<std::string, unsigned long> stacks;
+    for (const auto &sample : samples)
+    {
+        std::string stack;
+        for (size_t pc : sample.first)
+        {
+            if (!stack.empty())
+                stack += ';';
+            stack += function_at(program, pc);
+        }
+        stacks[stack] += sample.second;
+    }
+    for (const auto &entry : stacks)
+    {
+        os << entry.first << " " << entry.second << "\n";
+    }
+}
@@ -5,7 +5,7 @@ std::string SourceCode::replace_args(const std::vector<std::string>& args) {
         std::cout << "Argument Error: Incorrect amount of aruments (expected " << arg_names.size() << " arguments, got " << args.size() << " arguments).";
     }
 
-    std::string ret = raw;
+    std::string ret(data(), size());
     for (size_t i = 0; i < args.size(); i++) {
         // https://stackoverflow.com/a/3418285/16191068
         if (arg_names[i].empty()) continue;
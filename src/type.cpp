@@ -1,24 +1,61 @@
 #include "type.hpp"
 
-int Value::get_type() {
-    return type;
+char *Value::init_string(size_t len) {
+    type = type_string;
+    if (len <= small_capacity) {
+        heap = false;
+        small_len = len;
+        return small;
+    }
+    heap = true;
+    val_heap = static_cast<Shared *>(::operator new(sizeof(Shared) + len));
+    val_heap->refs = 1;
+    val_heap->size = len;
+    return val_heap->data();
+}
+
+void Value::set_string(const char *data, size_t len) {
+    memcpy(init_string(len), data, len);
+}
+
+void Value::copy_from(const Value &other) {
+    type = other.type;
+    heap = other.heap;
+    small_len = other.small_len;
+    memcpy(small, other.small, small_capacity); // covers val_int and val_heap too
+    if (heap)
+        val_heap->refs++;
+}
+
+Value Value::concat(const Value &a, const Value &b) {
+    Value result;
+    char *data = result.init_string(a.string_size() + b.string_size());
+    memcpy(data, a.string_data(), a.string_size());
+    memcpy(data + a.string_size(), b.string_data(), b.string_size());
+    return result;
+}
+
+Value Value::char_at(int i) const {
+    if (type != type_string)
+        throw std::invalid_argument("Argument Error: incorrect argument type (did not get int)!");
+    if (i < 0 || (size_t)i >= string_size())
+        throw std::invalid_argument("Argument Error: string index out of range!");
+    return Value(string_data()[i]);
 }
 
 int Value::get_int() const {
     if (type == type_int) {
         return val_int;
     } else {
-        std::cout << "Argument Error: incorrect argument type (did not get string)!";
-        exit(1);
+        throw std::invalid_argument("Argument Error: incorrect argument type (did not get string)!");
     }
 }
 
 std::string Value::get_string() const {
     if (type == type_string) {
-        return val_string;
+        return std::string(string_data(), string_size());
     } else {
-        std::cout << "Argument Error: incorrect argument type (did not get int)!";
-        exit(1);
+        throw std::invalid_argument("Argument Error: incorrect argument type (did not get int)!");
     }
 }
 
@@ -26,10 +63,9 @@ std::string Value::to_string() const {
     if (type == type_int) {
         return std::to_string(val_int);
     } else if (type == type_string) {
-        return val_string;
+        return get_string();
     } else {
-        std::cout << "Argument Error: argument is of illegal type";
-        exit(1);
+        throw std::invalid_argument("Argument Error: argument is of illegal type");
     }
 }
 
@@ -0,0 +1,506 @@
+#include "parser.hpp"
+
+// a profiler tick is taken between two instructions
+#define VM_POLL()                          \
+    do                                     \
+    {                                      \
+        if (Profiler::pending)             \
+            sample(pc);                    \
+    } while (0)
+
+// instrumentation build: every dispatch charges the time since the previous one to
+// the instruction that ran in between, and VM_STAT bumps one of the other counters
+#ifdef PRINGLE_OPCODE_STATS
+#define VM_STATS()                                                          \
+    do                                                                      \
+    {                                                                       \
+        uint64_t stats_now = OpcodeStats::now();                            \
+        if (stats_op != op_count)                                           \
+            stats.record(stats_op, stats_now - stats_since);                \
+        stats_since = stats_now;                                            \
+        stats_op = code[pc].op;                                             \
+    } while (0)
+#define VM_STAT(update) stats.update
+#else
+#define VM_STATS() do {} while (0)
+#define VM_STAT(update) do {} while (0)
+#endif
+
+// with PRINGLE_THREADED_DISPATCH every handler jumps straight to the next
+// handler through a label table (computed goto, GCC/Clang only). otherwise
+// the same handlers are cases of a switch in a loop. either way every handler
+// has a label, so a quickened handler can fall back to its generic one. only a few
+// of those are goto targets in the switch build, the rest are marked unused
+#if defined(__GNUC__) || defined(__clang__)
+#define VM_CASE(op) case op: label_##op: __attribute__((unused));
+#else
+#define VM_CASE(op) case op: label_##op:
+#endif
+#if defined(PRINGLE_THREADED_DISPATCH) && (defined(__GNUC__) || defined(__clang__))
+#define VM_THREADED 1
+#define VM_NEXT()                          \
+    do                                     \
+    {                                      \
+        VM_STATS();                        \
+        VM_POLL();                         \
+        instr = &code[pc++];               \
+        goto *dispatch_table[instr->op];   \
+    } while (0)
+#else
+#define VM_THREADED 0
+#define VM_NEXT() continue
+#endif
+
+// handlers don't check the stack depth themselves, Parser::insert_stack_checks
+// puts an op_check_depth in front of every instruction it can't prove safe
+
+// binds x (left hand) and y (right hand) to the top two stack slots.
+// binary operators write the result over x and then drop y
+#define VM_BINARY_OPERANDS()                                    \
+    Value &x = stack[stack.size() - 2];                         \
+    const Value &y = stack.back()
+
+// fused push_int K, compare, jump_if_false (see Parser::optimize).
+// the dup variants compare the top of the stack without popping it
+#define VM_COMPARE_CONST_BRANCH(cmp, pop)                       \
+    {                                                           \
+        int v = stack.back().get_int();                         \
+        if (pop)                                                \
+            stack.pop_back();                                   \
+        if (!(v cmp instr->operand))                            \
+            pc = instr->operand2;                               \
+    }
+
+// quickening: once a generic instruction has run, it rewrites itself into the
+// form specialised for the operand types it saw. the specialised handler only
+// checks the tags and, if they don't match, rewrites the instruction back to
+// the generic form and runs that instead
+#define VM_DEOPTIMIZE(generic)          \
+    do                                  \
+    {                                   \
+        instr->op = generic;            \
+        goto label_##generic;           \
+    } while (0)
+
+// int-int specialisation of a binary operator, expr reads x.as_int() and y.as_int()
+#define VM_INT_BINARY(generic, expr)                    \
+    {                                                   \
+        VM_BINARY_OPERANDS();                           \
+        if (!x.is_int() || !y.is_int())                 \
+            VM_DEOPTIMIZE(generic);                     \
+        x.set_int(expr);                                \
+        stack.pop_back();                               \
+    }
+
+void Parser::sample(size_t pc)
+{
+    Profiler::pending = 0;
+    if (!profiler)
+        return;
+    std::vector<size_t> stack;
+    stack.reserve(frames.size() + 1);
+    for (const Frame &frame : frames)
+    {
+        stack.push_back(frame.return_pc - 1); // the call
+    }
+    stack.push_back(pc);
+    profiler->record(stack);
+}
+
+int Parser::run(size_t pc)
+{
+    // nothing is compiled while running, so this pointer stays valid.
+    // not const, quickening rewrites instructions in place
+    Instr *code = program.code.data();
+    Instr *instr;
+
+#if VM_THREADED
+    // must list a label for every OpCode, in enum order
+    static const void *const dispatch_table[] = {
+        &&label_op_push_int, &&label_op_push_str, &&label_op_print, &&label_op_flush,
+        &&label_op_func, &&label_op_var, &&label_op_identifier, &&label_op_load_local,
+        &&label_op_store_local, &&label_op_jump, &&label_op_jump_if_false, &&label_op_break,
+        &&label_op_return, &&label_op_dup, &&label_op_swap, &&label_op_over,
+        &&label_op_twodup, &&label_op_pop, &&label_op_index, &&label_op_add,
+        &&label_op_sub, &&label_op_mul, &&label_op_div, &&label_op_mod,
+        &&label_op_pow, &&label_op_lt, &&label_op_gt, &&label_op_eq,
+        &&label_op_and, &&label_op_or, &&label_op_not, &&label_op_add_const,
+        &&label_op_sub_const, &&label_op_eq_const_branch, &&label_op_lt_const_branch, &&label_op_gt_const_branch,
+        &&label_op_dup_eq_const_branch, &&label_op_dup_lt_const_branch, &&label_op_dup_gt_const_branch, &&label_op_mul_locals,
+        &&label_op_check_depth, &&label_op_add_int, &&label_op_add_str, &&label_op_sub_int,
+        &&label_op_mul_int, &&label_op_lt_int, &&label_op_gt_int, &&label_op_eq_int,
+        &&label_op_add_const_int, &&label_op_sub_const_int, &&label_op_call, &&label_op_load_var,
+        &&label_op_jit_loop,
+    };
+    static_assert(sizeof(dispatch_table) / sizeof(dispatch_table[0]) == op_count, "dispatch table is out of sync with OpCode");
+#endif
+
+#ifdef PRINGLE_OPCODE_STATS
+    uint64_t stats_since = OpcodeStats::now();
+    OpCode stats_op = op_count; // nothing has run yet
+#endif
+
+    while (true)
+    {
+        VM_STATS();
+        VM_POLL();
+        instr = &code[pc++];
+        switch (instr->op)
+        {
+        VM_CASE(op_push_int)
+            stack.emplace_back(instr->operand);
+            VM_NEXT();
+        VM_CASE(op_push_str)
+            stack.push_back(literals[instr->operand]);
+            VM_NEXT();
+        VM_CASE(op_pop)
+            stack.pop_back();
+            VM_NEXT();
+        VM_CASE(op_dup)
+            stack.push_back(stack.back());
+            VM_NEXT();
+        VM_CASE(op_twodup)
+        {
+            size_t n = stack.size();
+            stack.push_back(stack[n - 2]);
+            stack.push_back(stack[n - 1]);
+        }
+            VM_NEXT();
+        VM_CASE(op_swap)
+        {
+            size_t n = stack.size();
+            std::swap(stack[n - 1], stack[n - 2]);
+        }
+            VM_NEXT();
+        VM_CASE(op_over)
+            stack.push_back(stack[stack.size() - 3]);
+            VM_NEXT();
+        VM_CASE(op_print)
+            out.write(stack.back());
+            stack.pop_back();
+            VM_NEXT();
+        VM_CASE(op_flush)
+            out.flush();
+            VM_NEXT();
+        VM_CASE(op_func)
+            // also a redefinition, call sites may have cached the old body
+            functions[program.funcs[instr->operand].name] = instr->operand;
+            names_epoch++;
+            VM_NEXT();
+        VM_CASE(op_var)
+            if (variables[instr->operand].get_type() == type_none)
+                names_epoch++;
+            variables[instr->operand] = std::move(stack.back());
+            stack.pop_back();
+            VM_NEXT();
+        VM_CASE(op_jump)
+            VM_STAT(loop_iterations += (size_t)instr->operand < pc);
+#if PRINGLE_JIT_ENABLED
+            // back edges count how often they are taken in operand2 up to the threshold,
+            // then the loop gets compiled once
+            if ((size_t)instr->operand < pc && instr->operand2 < Jit::threshold && ++instr->operand2 == Jit::threshold)
+            {
+                int loop = jit.compile(program, instr->operand, pc - 1, functions);
+                if (loop >= 0)
+                {
+                    instr->op = op_jit_loop;
+                    instr->operand2 = loop;
+                }
+            }
+#endif
+            pc = instr->operand;
+            VM_NEXT();
+        VM_CASE(op_jit_loop)
+#if PRINGLE_JIT_ENABLED
+            if (jit.usable(instr->operand2, functions))
+            {
+                // compiled code pushes into default constructed slots past the top
+                size_t depth = stack.size();
+                stack.resize(depth + Jit::stack_slack);
+                JitState state = {stack.data(), depth, depth + Jit::stack_slack, variables.data(), locals.data() + frame_base};
+                pc = jit.enter(instr->operand2, state);
+                stack.resize(state.depth);
+                VM_NEXT();
+            }
+            // back to an ordinary jump that doesn't get compiled again
+            instr->op = op_jump;
+            instr->operand2 = Jit::threshold;
+#endif
+            pc = instr->operand;
+            VM_NEXT();
+        VM_CASE(op_jump_if_false)
+            if (stack.back().get_int() <= 0)
+                pc = instr->operand;
+            stack.pop_back();
+            VM_NEXT();
+        VM_CASE(op_return)
+            if (frames.empty())
+                return 0;
+            locals.resize(frame_base);
+            frame_base = frames.back().frame_base;
+            pc = frames.back().return_pc;
+            frames.pop_back();
+            VM_NEXT();
+        VM_CASE(op_break)
+            // a break outside of any loop returns from the current function, or stops the program
+            if (frames.empty())
+                return 2;
+            goto label_op_return;
+        VM_CASE(op_identifier)
+            // resolve the name and cache the result in this instruction
+            if (functions[instr->operand] >= 0)
+            {
+                instr->op = op_call;
+                instr->operand = functions[instr->operand];
+                instr->operand2 = names_epoch;
+                goto label_op_call;
+            }
+            else if (variables[instr->operand].get_type() != type_none)
+            {
+                instr->op = op_load_var;
+                instr->operand2 = names_epoch;
+                stack.push_back(variables[instr->operand]);
+            }
+            else
+            {
+                diag << "Name Error: undeclared variable/function: \"" << program.symbols[instr->operand] << "\".\n";
+                return 1;
+            }
+            VM_NEXT();
+        VM_CASE(op_call)
+        {
+            const FuncDef &func = program.funcs[instr->operand];
+            if ((unsigned)instr->operand2 != names_epoch)
+            {
+                instr->operand = func.name;
+                VM_DEOPTIMIZE(op_identifier);
+            }
+
+            VM_STAT(calls++);
+
+            // move the arguments off the operand stack into a fresh frame, first argument is the deepest
+            size_t n = stack.size();
+            size_t argc = func.argc;
+            if (n < argc)
+            {
+                diag << "Error: not enough arguments in stack for \"" << program.symbols[func.name] << "\".\n";
+                return 1;
+            }
+            if (code[pc].op == op_return && !frames.empty())
+            {
+                // tail call, the callee reuses this frame and returns straight to our caller
+                locals.resize(frame_base);
+            }
+            else
+            {
+                frames.push_back({pc, frame_base});
+                frame_base = locals.size();
+            }
+            for (size_t i = n - argc; i < n; i++)
+            {
+                locals.push_back(std::move(stack[i]));
+            }
+            stack.resize(n - argc);
+            pc = func.entry;
+        }
+            VM_NEXT();
+        VM_CASE(op_load_var)
+            if ((unsigned)instr->operand2 != names_epoch)
+                VM_DEOPTIMIZE(op_identifier);
+            stack.push_back(variables[instr->operand]);
+            VM_NEXT();
+        VM_CASE(op_load_local)
+            stack.push_back(locals[frame_base + instr->operand]);
+            VM_NEXT();
+        VM_CASE(op_store_local)
+            locals[frame_base + instr->operand] = std::move(stack.back());
+            stack.pop_back();
+            VM_NEXT();
+        VM_CASE(op_index)
+        {
+            VM_BINARY_OPERANDS();
+            x = x.char_at(y.get_int());
+            stack.pop_back();
+        }
+            VM_NEXT();
+        VM_CASE(op_add)
+        {
+            VM_BINARY_OPERANDS();
+            if (x.get_type() == type_int && y.get_type() == type_int)
+            {
+                x = x.get_int() + y.get_int();
+                instr->op = op_add_int;
+            }
+            else if (x.get_type() == type_string && y.get_type() == type_string)
+            {
+                x = Value::concat(x, y);
+                instr->op = op_add_str;
+            }
+            else
+            {
+                throw std::invalid_argument("Argument Error: incorrect argument types (did not get two ints or two strings)!");
+            }
+            stack.pop_back();
+        }
+            VM_NEXT();
+        VM_CASE(op_sub)
+        {
+            VM_BINARY_OPERANDS();
+            x = x.get_int() - y.get_int();
+            stack.pop_back();
+            instr->op = op_sub_int;
+        }
+            VM_NEXT();
+        VM_CASE(op_mul)
+        {
+            VM_BINARY_OPERANDS();
+            x = x.get_int() * y.get_int();
+            stack.pop_back();
+            instr->op = op_mul_int;
+        }
+            VM_NEXT();
+        VM_CASE(op_div)
+        {
+            VM_BINARY_OPERANDS();
+            x = x.get_int() / y.get_int();
+            stack.pop_back();
+        }
+            VM_NEXT();
+        VM_CASE(op_mod)
+        {
+            VM_BINARY_OPERANDS();
+            x = x.get_int() % y.get_int();
+            stack.pop_back();
+        }
+            VM_NEXT();
+        VM_CASE(op_pow)
+        {
+            VM_BINARY_OPERANDS();
+            x = (int)pow(x.get_int(), y.get_int()); // coerce double to int by flooring
+            stack.pop_back();
+        }
+            VM_NEXT();
+        VM_CASE(op_lt)
+        {
+            VM_BINARY_OPERANDS();
+            x = x.get_int() < y.get_int();
+            stack.pop_back();
+            instr->op = op_lt_int;
+        }
+            VM_NEXT();
+        VM_CASE(op_gt)
+        {
+            VM_BINARY_OPERANDS();
+            x = x.get_int() > y.get_int();
+            stack.pop_back();
+            instr->op = op_gt_int;
+        }
+            VM_NEXT();
+        VM_CASE(op_eq)
+        {
+            VM_BINARY_OPERANDS();
+            x = x.get_int() == y.get_int();
+            stack.pop_back();
+            instr->op = op_eq_int;
+        }
+            VM_NEXT();
+        VM_CASE(op_and)
+        {
+            VM_BINARY_OPERANDS();
+            x = x.get_int() && y.get_int();
+            stack.pop_back();
+        }
+            VM_NEXT();
+        VM_CASE(op_or)
+        {
+            VM_BINARY_OPERANDS();
+            x = x.get_int() || y.get_int();
+            stack.pop_back();
+        }
+            VM_NEXT();
+        VM_CASE(op_not)
+            stack.back() = !stack.back().get_int();
+            VM_NEXT();
+        VM_CASE(op_add_const)
+            if (stack.back().get_type() != type_int)
+                throw std::invalid_argument("Argument Error: incorrect argument types (did not get two ints or two strings)!");
+            stack.back() = stack.back().get_int() + instr->operand;
+            instr->op = op_add_const_int;
+            VM_NEXT();
+        VM_CASE(op_sub_const)
+            stack.back() = stack.back().get_int() - instr->operand;
+            instr->op = op_sub_const_int;
+            VM_NEXT();
+        VM_CASE(op_eq_const_branch)
+            VM_COMPARE_CONST_BRANCH(==, true);
+            VM_NEXT();
+        VM_CASE(op_lt_const_branch)
+            VM_COMPARE_CONST_BRANCH(<, true);
+            VM_NEXT();
+        VM_CASE(op_gt_const_branch)
+            VM_COMPARE_CONST_BRANCH(>, true);
+            VM_NEXT();
+        VM_CASE(op_dup_eq_const_branch)
+            VM_COMPARE_CONST_BRANCH(==, false);
+            VM_NEXT();
+        VM_CASE(op_dup_lt_const_branch)
+            VM_COMPARE_CONST_BRANCH(<, false);
+            VM_NEXT();
+        VM_CASE(op_dup_gt_const_branch)
+            VM_COMPARE_CONST_BRANCH(>, false);
+            VM_NEXT();
+        VM_CASE(op_mul_locals)
+            stack.emplace_back(locals[frame_base + instr->operand].get_int() * locals[frame_base + instr->operand2].get_int());
+            VM_NEXT();
+        VM_CASE(op_check_depth)
+            if (stack.size() < (size_t)instr->operand)
+            {
+                // fail the way the guarded instruction always has
+                if (instr->operand2 == op_pop)
+                    throw std::logic_error("Cannot pop empty stack");
+                diag << (instr->operand2 == op_not ? "Error: no operand in stack.\n" : "Error: not enough operands in stack.\n");
+                return 1;
+            }
+            VM_NEXT();
+        VM_CASE(op_add_int)
+            VM_INT_BINARY(op_add, x.as_int() + y.as_int());
+            VM_NEXT();
+        VM_CASE(op_add_str)
+        {
+            VM_BINARY_OPERANDS();
+            if (x.get_type() != type_string || y.get_type() != type_string)
+                VM_DEOPTIMIZE(op_add);
+            x = Value::concat(x, y);
+            stack.pop_back();
+        }
+            VM_NEXT();
+        VM_CASE(op_sub_int)
+            VM_INT_BINARY(op_sub, x.as_int() - y.as_int());
+            VM_NEXT();
+        VM_CASE(op_mul_int)
+            VM_INT_BINARY(op_mul, x.as_int() * y.as_int());
+            VM_NEXT();
+        VM_CASE(op_lt_int)
+            VM_INT_BINARY(op_lt, x.as_int() < y.as_int());
+            VM_NEXT();
+        VM_CASE(op_gt_int)
+            VM_INT_BINARY(op_gt, x.as_int() > y.as_int());
+            VM_NEXT();
+        VM_CASE(op_eq_int)
+            VM_INT_BINARY(op_eq, x.as_int() == y.as_int());
+            VM_NEXT();
+        VM_CASE(op_add_const_int)
+            if (!stack.back().is_int())
+                VM_DEOPTIMIZE(op_add_const);
+            stack.back().set_int(stack.back().as_int() + instr->operand);
+            VM_NEXT();
+        VM_CASE(op_sub_const_int)
+            if (!stack.back().is_int())
+                VM_DEOPTIMIZE(op_sub_const);
+            stack.back().set_int(stack.back().as_int() - instr->operand);
+            VM_NEXT();
+        case op_count:
+            break;
+        }
+    }
+}
@@ -1,5 +1,11 @@
 #include <catch.hpp>
 #include "parser.hpp"
+#include "mapped_file.hpp"
+#include "bytecode_cache.hpp"
+#include "arena.hpp"
+#include "profiler.hpp"
+
+#include <sstream>
 
 // NOTE: putting each "line" in quotes will not put newlines between the lines. beware of unexpected errors caused by this lack of whitespace.
 
@@ -557,3 +563,552 @@ TEST_CASE("pop with empty stack", "[Stack manipulation]") {
     REQUIRE_THROWS_AS(get_exit_code("pop"), std::logic_error);
 }
 
+
+TEST_CASE("Loop body is run until break", "[loop]") {
+    Value top = get_top(
+        "0 "
+        "loop {"
+        "    1 +"
+        "    dup 1000 = if {break}"
+        "}"
+    );
+    REQUIRE(top == 1000);
+}
+
+TEST_CASE("Tokens do not need whitespace after them", "[lexer]") {
+    Value top = get_top(
+        "func inc x {x 1+} 3 5+inc"
+    );
+    REQUIRE(top == 9);
+}
+
+TEST_CASE("Unclosed block throws error", "[bracket error 3]") {
+    int exit_code = get_exit_code(
+        "1 loop { 1 +"
+    );
+    REQUIRE(exit_code == 1);
+}
+
+TEST_CASE("Break only leaves the innermost loop", "[nested loop break]") {
+    Value top = get_top(
+        "0 var n "
+        "loop {"
+        "    loop { n 1 + var n break }"
+        "    n 3 = if { break }"
+        "}"
+        "n"
+    );
+    REQUIRE(top == 3);
+}
+
+TEST_CASE("Break outside of a loop stops the program", "[break outside loop]") {
+    int exit_code = get_exit_code(
+        "1 if { break } 2 print"
+    );
+    REQUIRE(exit_code == 2);
+}
+
+TEST_CASE("Function arguments are undeclared after the call", "[function argument scope]") {
+    int exit_code = get_exit_code(
+        "func f a { a } 1 f a"
+    );
+    REQUIRE(exit_code == 1);
+}
+
+TEST_CASE("long strings can get concatenated and indexed") {
+    Value top = get_top(
+        "\"a long string\" dup \" and then some\" + swap pop 18 ."
+    );
+    REQUIRE(top == "t");
+}
+
+TEST_CASE("Integer literal that does not fit in an int throws", "[lexer]") {
+    REQUIRE_THROWS_AS(get_exit_code("99999999999"), std::out_of_range);
+}
+
+TEST_CASE("Comments are skipped up to the end of the line", "[lexer]") {
+    Value top = get_top(
+        "1 # 2 3 +\n"
+        "4 + # trailing comment"
+    );
+    REQUIRE(top == 5);
+}
+
+TEST_CASE("Recursive calls keep their own arguments", "[function recursion]") {
+    Value top = get_top(
+        "func fact n {"
+        "    1 var r"
+        "    n 1 > if { n 1 - fact n * var r }"
+        "    r"
+        "}"
+        "5 fact"
+    );
+    REQUIRE(top == 120);
+}
+
+TEST_CASE("Function arguments shadow globals without clobbering them", "[function argument scope]") {
+    Value top = get_top(
+        "1 var a "
+        "func f a { a 10 + var a a } "
+        "2 f pop a"
+    );
+    REQUIRE(top == 1);
+}
+
+TEST_CASE("Script can be run from a mapped file", "[mapped file]") {
+    const char *path = "mapped_file_test.txt";
+    std::ofstream(path) << "func sq x { x x * } 12 sq";
+
+    MappedFile file;
+    REQUIRE(file.open(path));
+    SourceCode src = SourceCode::from_view(file.data(), file.size());
+    Parser parser;
+    REQUIRE(parser.parse(src) == 0);
+    REQUIRE(parser.try_peek() == 144);
+    std::remove(path);
+}
+
+TEST_CASE("Output can be captured in a string", "[output]") {
+    std::string output;
+    Parser parser;
+    parser.set_output(output);
+    std::string raw = "1 2 + print \" apples \" print 0 7 - print flush";
+    SourceCode src = SourceCode(raw);
+
+    REQUIRE(parser.parse(src) == 0);
+    REQUIRE(output == "3 apples -7");
+}
+
+TEST_CASE("Errors are written in order with printed output", "[output]") {
+    std::string output;
+    Parser parser;
+    parser.set_output(output);
+    std::string raw = "1 print \"a\" 1 - print";
+    SourceCode src = SourceCode(raw);
+
+    REQUIRE(parser.parse(src) == 1);
+    REQUIRE(output.find("1Argument Error") == 0);
+}
+
+TEST_CASE("Jumping between fusable instructions", "[superinstructions]") {
+    REQUIRE(get_top("2 3 0 if { 5 } +") == 5);
+    REQUIRE(get_top("2 3 1 if { 5 } +") == 8);
+    REQUIRE(get_top("1 0 if { 0 } 7 -") == -6);
+}
+
+TEST_CASE("Fused idioms give the same results", "[superinstructions]") {
+    REQUIRE(get_top("0 5 - 3 +") == -2);
+    REQUIRE(get_top("func square x { x x * } 0 12 - square") == 144);
+    REQUIRE(get_top("0 loop { 1 + dup 10 > if { break } }") == 11);
+    REQUIRE(get_top("0 loop { 1 + dup 10 < ! if { break } }") == 10);
+    REQUIRE(get_exit_code("1 +") == 1);
+}
+
+TEST_CASE("Literal expressions are folded", "[constant folding]") {
+    REQUIRE(get_top("6 3 / 10 2 / + 3 -") == 4);
+    REQUIRE(get_top("2 3 4 * + 1 !") == 0);
+    REQUIRE(get_top("2 10 ^ 1000 >") == 1);
+    REQUIRE(get_top("\"a\" 2 3 + pop") == "a");
+}
+
+TEST_CASE("If on a literal condition", "[constant folding]") {
+    REQUIRE(get_top("3 1 if { 4 + }") == 7);
+    REQUIRE(get_top("3 0 if { 4 + }") == 3);
+    REQUIRE(get_top("3 0 1 - if { 4 + }") == 3);
+    REQUIRE(get_top("0 loop { 1 + 0 if { break } dup 5 = if { break } }") == 5);
+    REQUIRE(get_top("0 loop { 1 + 1 if { break } }") == 1);
+
+    // the literal condition is the loop head, so 0 and 1 + must not be folded across it
+    Parser parser;
+    std::string output;
+    parser.set_output(output);
+    std::string raw = "0 loop { 1 if { 1 + } dup print dup 5 = if { break } }";
+    SourceCode src = SourceCode(raw);
+    REQUIRE(parser.parse(src) == 0);
+    REQUIRE(output == "12345");
+}
+
+TEST_CASE("Stack commands on a too shallow stack throw errors", "[operand error]") {
+    REQUIRE(get_exit_code("dup") == 1);
+    REQUIRE(get_exit_code("1 swap") == 1);
+    REQUIRE(get_exit_code("1 2 over") == 1);
+    REQUIRE(get_exit_code("1 twodup") == 1);
+    REQUIRE(get_exit_code("print") == 1);
+}
+
+TEST_CASE("Stack depth is rechecked when a loop comes around", "[operand error]") {
+    REQUIRE_THROWS_AS(get_exit_code("1 2 loop { pop }"), std::logic_error);
+    REQUIRE_THROWS_AS(get_exit_code("func f { pop } 1 f f"), std::logic_error);
+    REQUIRE(get_exit_code("1 2 3 loop { + dup 6 = if { break } }") == 0);
+}
+
+TEST_CASE("Adding an int to a string throws error", "[operand error]") {
+    REQUIRE(get_exit_code("2 \"a\" + dup") == 1);
+}
+
+TEST_CASE("Quickened instructions fall back when operand types change", "[quickening]") {
+    REQUIRE(get_top("func plus a b { a b + } 1 2 plus pop \"x\" \"y\" plus pop 3 4 plus") == 7);
+    REQUIRE(get_top("func plus a b { a b + } 1 2 plus pop 3 4 plus pop \"x\" \"y\" plus") == "xy");
+    REQUIRE(get_exit_code("func lt a b { a b < } 1 2 lt pop \"x\" \"y\" lt") == 1);
+}
+
+TEST_CASE("Hot loops give the same results", "[jit]") {
+    REQUIRE(get_top("0 var i 0 var s loop { i 1 + var i s i 3 % + var s i 1000 = if { break } } s") == 1000);
+    REQUIRE(get_top("func f n { 0 loop { n 1 - var n n 0 = if { break } n n * + } } 300 f") == 8955050);
+    REQUIRE(get_top("0 var d loop { d 1 + var d 1000 d / pop d 300 = if { break } } d") == 300);
+    REQUIRE(get_top("0 loop { dup 1000 = if { break } 1 + dup }") == 1000);
+    REQUIRE(get_top("\"s\" 0 loop { 1 + dup 1000 = if { break } } swap") == "s");
+}
+
+TEST_CASE("Hot loops fall back to the interpreter", "[jit]") {
+    REQUIRE(get_top("0 var i 0 loop { i 1 + var i i 300 = if { \"x\" var i break } 1 + } pop i") == "x");
+    REQUIRE(get_exit_code("0 var i loop { i 1 + var i i 200 = if { \"x\" var i } }") == 1);
+    REQUIRE(get_top("func g { 0 var i loop { i 1 + var i i k > if { break } } i } 500 var k g pop func k { 10 } g") == 11);
+}
+
+TEST_CASE("Deep recursion doesn't grow the native stack", "[functions]") {
+    REQUIRE(get_top("func sum n { n 0 = if { 0 break } n n 1 - sum + } 60000 sum") == 1800030000);
+    REQUIRE(get_top("func count n acc { n 0 = if { acc break } n 1 - acc 1 + count } 1000000 0 count") == 1000000);
+}
+
+TEST_CASE("Calls return to the right place", "[functions]") {
+    REQUIRE(get_top("func inc x { x 1 + } func twice x { x inc inc } 5 twice 10 +") == 17);
+    REQUIRE(get_top("func last x { x 1 - } func mid x { x last } 7 mid 1 +") == 7);
+}
+
+TEST_CASE("A failed call leaves no frames behind", "[functions]") {
+    Parser parser;
+    std::string output;
+    parser.set_output(output);
+    std::string failing = "func f x { x \"a\" + } 1 f";
+    SourceCode src = SourceCode(failing);
+    REQUIRE(parser.parse(src) == 1);
+
+    std::string raw = "func g x { x 2 * } 4 g";
+    SourceCode next = SourceCode(raw);
+    REQUIRE(parser.parse(next) == 0);
+    REQUIRE(parser.try_peek() == 8);
+}
+
+TEST_CASE("Identifier sites notice redefinitions", "[inline caches]") {
+    REQUIRE(get_top("func f { 1 } func g { f } g pop func f { 2 } g") == 2);
+    REQUIRE(get_top("5 var x func g { x } g pop func x { 9 } g") == 9);
+    REQUIRE(get_top("0 var n func g { n } loop { g 1 + var n n 100 = if { break } } g") == 100);
+    REQUIRE(get_exit_code("func g { y } 1 var z g") == 1);
+}
+
+TEST_CASE("Compiled programs are cached on disk", "[bytecode cache]") {
+    const char *cache = "bytecode_cache_test.pbc";
+    std::remove(cache);
+    std::string raw = "func sq x { x x * } 0 loop { 1 + dup 10 = if { break } } sq \"s\" pop";
+
+    for (int run = 0; run < 2; run++)
+    {
+        Parser parser;
+        std::string text = raw; // SourceCode takes the string
+        SourceCode src = SourceCode(text);
+        REQUIRE(parser.parse_cached(src, cache) == 0);
+        REQUIRE(parser.try_peek() == 100);
+    }
+
+    Program program;
+    REQUIRE(load_program(cache, hash_source(raw.data(), raw.size()), program));
+    REQUIRE(program.strings.size() == 1);
+    REQUIRE(program.funcs.size() == 1);
+    REQUIRE(program.symbols[program.funcs[0].name].str() == "sq");
+    REQUIRE_FALSE(load_program(cache, hash_source("1", 1), program));
+
+    // an edited script misses and replaces the cache
+    std::string edited = "func sq x { x x * } 7 sq";
+    std::string text = edited;
+    Parser parser;
+    SourceCode src = SourceCode(text);
+    REQUIRE(parser.parse_cached(src, cache) == 0);
+    REQUIRE(parser.try_peek() == 49);
+    REQUIRE(load_program(cache, hash_source(edited.data(), edited.size()), program));
+    std::remove(cache);
+}
+
+TEST_CASE("A damaged cache file is ignored", "[bytecode cache]") {
+    const char *cache = "bytecode_cache_damaged.pbc";
+    std::string raw = "2 3 * 1 +";
+    {
+        Parser parser;
+        std::string text = raw;
+        SourceCode src = SourceCode(text);
+        REQUIRE(parser.parse_cached(src, cache) == 0);
+    }
+    std::string bytes;
+    {
+        std::ifstream in(cache, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    std::ofstream(cache, std::ios::binary) << bytes.substr(0, bytes.size() - 3);
+
+    Program program;
+    REQUIRE_FALSE(load_program(cache, hash_source(raw.data(), raw.size()), program));
+    Parser parser;
+    SourceCode src = SourceCode(raw);
+    REQUIRE(parser.parse_cached(src, cache) == 0);
+    REQUIRE(parser.try_peek() == 7);
+
+    // any changed byte fails the checksum
+    bytes[bytes.size() - 5] ^= 1;
+    std::ofstream(cache, std::ios::binary) << bytes;
+    REQUIRE_FALSE(load_program(cache, hash_source(raw.data(), raw.size()), program));
+    std::remove(cache);
+}
+
+// func f x { x } saved with a valid checksum, then loaded back
+static bool load_saved(const std::vector<Instr> &code)
+{
+    static const int arg_names[] = {0};
+    const char *cache = "bytecode_cache_checked.pbc";
+    Program saved;
+    saved.code = code;
+    saved.symbols.push_back({"f", 1});
+    FuncDef def;
+    def.name = 0;
+    def.arg_names = arg_names;
+    def.argc = 1;
+    def.entry = 2;
+    def.end = 4;
+    saved.funcs.push_back(def);
+    REQUIRE(save_program(cache, saved, 1));
+    Program loaded;
+    bool ok = load_program(cache, 1, loaded);
+    std::remove(cache);
+    return ok;
+}
+
+TEST_CASE("Cache files that could misbehave are rejected", "[bytecode cache]") {
+    REQUIRE(load_saved({{op_func, 0}, {op_jump, 4}, {op_load_local, 0}, {op_return}, {op_return}}));
+    // a slot past the frame, or any slot outside of a function
+    REQUIRE_FALSE(load_saved({{op_func, 0}, {op_jump, 4}, {op_load_local, 1}, {op_return}, {op_return}}));
+    REQUIRE_FALSE(load_saved({{op_func, 0}, {op_jump, 4}, {op_load_local, 0}, {op_return}, {op_load_local, 0}, {op_return}}));
+    // jumps past the end or into a body
+    REQUIRE_FALSE(load_saved({{op_func, 0}, {op_jump, 5}, {op_load_local, 0}, {op_return}, {op_return}}));
+    REQUIRE_FALSE(load_saved({{op_func, 0}, {op_jump, 3}, {op_load_local, 0}, {op_return}, {op_return}}));
+    // an instruction that could find the stack too shallow without its guard
+    REQUIRE(load_saved({{op_func, 0}, {op_jump, 4}, {op_load_local, 0}, {op_return}, {op_check_depth, 1, op_pop}, {op_pop}, {op_return}}));
+    REQUIRE_FALSE(load_saved({{op_func, 0}, {op_jump, 4}, {op_load_local, 0}, {op_return}, {op_pop}, {op_return}}));
+}
+
+TEST_CASE("Arena allocations stay put and aligned", "[arena]") {
+    Arena arena;
+    std::vector<const char *> copies;
+    std::string text = "identifier";
+    for (int i = 0; i < 2000; i++)
+    {
+        copies.push_back(arena.copy(text.data(), text.size()));
+        REQUIRE((uintptr_t)arena.allocate(sizeof(double), alignof(double)) % alignof(double) == 0);
+    }
+    char *big = (char *)arena.allocate(1 << 20, 1);
+    memset(big, 'x', 1 << 20);
+    for (const char *copy : copies)
+    {
+        REQUIRE(std::string(copy, text.size()) == text);
+    }
+
+    Arena moved = std::move(arena);
+    REQUIRE(std::string(copies.back(), text.size()) == text);
+}
+
+TEST_CASE("Empty strings and argument lists compile", "[arena]") {
+    REQUIRE(get_top("func f { \"\" } f \"a\" +") == "a");
+}
+
+TEST_CASE("Profiler samples functions and lines", "[profiler]") {
+    Profiler profiler;
+    Parser parser;
+    parser.set_profiler(&profiler);
+    std::string raw = "func step x { x 3 * 7 % }\n"
+                      "func spin n { 0 loop { n step + n 1 - var n n 0 = if { break } } }\n"
+                      "3000000 spin";
+    SourceCode src = SourceCode(raw);
+    REQUIRE(profiler.start());
+    REQUIRE(parser.parse(src) == 0);
+    profiler.stop();
+
+    REQUIRE(profiler.sample_count() > 0);
+    std::ostringstream flat, collapsed;
+    profiler.write_flat(flat, parser.get_program());
+    profiler.write_collapsed(collapsed, parser.get_program());
+    REQUIRE(flat.str().find("spin") != std::string::npos);
+    REQUIRE(flat.str().find(":2\n") != std::string::npos);
+    REQUIRE(collapsed.str().find("(top level);spin") == 0);
+}
+
+TEST_CASE("Profiler doesn't charge samples to functions in dead code", "[profiler]") {
+    Profiler profiler;
+    Parser parser;
+    parser.set_profiler(&profiler);
+    // the string keeps the loop in the interpreter, where the samples are taken
+    std::string raw = "3000000 0 if { func dead { 1 } } loop { 1 - \"x\" pop dup 0 = if { break } }";
+    SourceCode src = SourceCode(raw);
+    REQUIRE(profiler.start());
+    REQUIRE(parser.parse(src) == 0);
+    profiler.stop();
+
+    REQUIRE(profiler.sample_count() > 0);
+    std::ostringstream flat;
+    profiler.write_flat(flat, parser.get_program());
+    REQUIRE(flat.str().find("dead") == std::string::npos);
+    REQUIRE(flat.str().find("(top level)") != std::string::npos);
+}
+
+TEST_CASE("A literal that throws inside a function body leaves nothing behind", "[profiler]") {
+    Profiler profiler;
+    Parser parser;
+    parser.set_profiler(&profiler);
+    std::string bad = "func unfinished x { x 99999999999 }";
+    SourceCode bad_src = SourceCode(bad);
+    REQUIRE_THROWS_AS(parser.parse(bad_src), std::out_of_range);
+    REQUIRE(parser.get_program().funcs.empty());
+    REQUIRE(parser.get_program().code.empty());
+
+    std::string raw = "3000000 loop { 1 - \"x\" pop dup 0 = if { break } }";
+    SourceCode src = SourceCode(raw);
+    REQUIRE(profiler.start());
+    REQUIRE(parser.parse(src) == 0);
+    profiler.stop();
+
+    REQUIRE(profiler.sample_count() > 0);
+    std::ostringstream flat;
+    profiler.write_flat(flat, parser.get_program());
+    REQUIRE(flat.str().find("unfinished") == std::string::npos);
+    REQUIRE(flat.str().find("(top level)") != std::string::npos);
+}
+
+TEST_CASE("Instrumented builds count every instruction", "[opcode stats]") {
+#ifdef PRINGLE_OPCODE_STATS
+    Parser parser;
+    std::string raw = "func f x { x dup * } 0 loop { 1 + dup f pop dup 10 = if { break } }";
+    SourceCode src = SourceCode(raw);
+    REQUIRE(parser.parse(src) == 0);
+
+    const OpcodeStats &stats = parser.get_stats();
+    REQUIRE(stats.calls == 10);
+    REQUIRE(stats.loop_iterations == 9);
+    REQUIRE(stats.counts[op_dup] + stats.counts[op_dup_eq_const_branch] >= 20);
+    REQUIRE(stats.counts[op_pop] == 10);
+
+    std::ostringstream json;
+    stats.write_json(json);
+    REQUIRE(json.str().find("\"pop\": {\"count\": 10") != std::string::npos);
+#else
+    SUCCEED("built without PRINGLE_OPCODE_STATS");
+#endif
+}
+
+TEST_CASE("A reset parser runs like a new one", "[reset]") {
+    Parser parser;
+    std::string output;
+    parser.set_output(output);
+
+    std::string first = "func sq x { x x * } 3 var n n sq \"hi\" print";
+    SourceCode src = SourceCode(first);
+    REQUIRE(parser.parse(src) == 0);
+    REQUIRE(parser.try_peek() == 9);
+
+    parser.reset();
+    REQUIRE(parser.get_stack().empty());
+    std::string uses_old_names = "n";
+    SourceCode next = SourceCode(uses_old_names);
+    REQUIRE(parser.parse(next) == 1);
+    parser.reset();
+    std::string calls_old_function = "2 sq";
+    SourceCode call = SourceCode(calls_old_function);
+    REQUIRE(parser.parse(call) == 1);
+    REQUIRE(output == "hiName Error: undeclared variable/function: \"n\".\n"
+                      "Name Error: undeclared variable/function: \"sq\".\n");
+}
+
+TEST_CASE("Running the same snippet after reset doesn't grow the program", "[reset]") {
+    Parser parser;
+    std::string output;
+    parser.set_output(output);
+    size_t code = 0, strings = 0, symbols = 0;
+    for (int i = 0; i < 100; i++)
+    {
+        parser.reset();
+        std::string raw = "func f a { a \"x\" + } \"y\" f var s 0 loop { 1 + dup 200 = if { break } }";
+        SourceCode src = SourceCode(raw);
+        REQUIRE(parser.parse(src) == 0);
+        REQUIRE(parser.try_peek() == 200);
+        if (i == 0)
+        {
+            code = parser.get_program().code.size();
+            strings = parser.get_program().strings.size();
+            symbols = parser.get_program().symbols.size();
+        }
+    }
+    REQUIRE(parser.get_program().code.size() == code);
+    REQUIRE(parser.get_program().strings.size() == strings);
+    REQUIRE(parser.get_program().symbols.size() == symbols);
+}
+
+TEST_CASE("Snippets with new literals and names every time don't grow a reset parser", "[reset]") {
+    Parser parser;
+    std::string output;
+    parser.set_output(output);
+    size_t limit = Parser::reset_symbol_limit;
+    for (size_t i = 0; i < limit + 100; i++)
+    {
+        parser.reset();
+        std::string n = std::to_string(i);
+        std::string raw = "\"literal " + n + "\" var v" + n + " v" + n + " \"literal " + n + "\" +";
+        SourceCode src = SourceCode(raw);
+        REQUIRE(parser.parse(src) == 0);
+        REQUIRE(parser.get_program().strings.size() == 1);
+        REQUIRE(parser.get_program().symbols.size() <= limit + 1);
+    }
+    parser.reset();
+    std::string raw = "2 var x x x *";
+    SourceCode src = SourceCode(raw);
+    REQUIRE(parser.parse(src) == 0);
+    REQUIRE(parser.try_peek() == 4);
+}
+
+TEST_CASE("Names close to keywords are identifiers", "[keywords]") {
+    // same first letter and length as a keyword, or a keyword with a suffix
+    REQUIRE(get_top("7 var prune prune") == 7);
+    REQUIRE(get_top("8 var dip dip") == 8);
+    REQUIRE(get_top("func ifs { 9 } ifs") == 9);
+    REQUIRE(get_top("5 var poppy 1 2 pop poppy") == 5);
+    REQUIRE(get_exit_code("1 2 3 over dup swap twodup pop pop 1 print flush") == 0);
+}
+
+TEST_CASE("Every operator character compiles and anything else is a syntax error", "[operators]") {
+    REQUIRE(get_top("7 2 + 3 - 4 * 6 / 5 % 2 ^") == 16);
+    REQUIRE(get_top("1 2 < 2 1 > & 0 | ! 1 1 = +") == 1);
+    REQUIRE(get_top("\"abc\" 1 .") == "b");
+    REQUIRE(get_exit_code("1 2 @") == 1);
+    REQUIRE(get_exit_code("1 \x80") == 1);
+}
+
+TEST_CASE("Copies of a long string share its characters", "[string sharing]") {
+    Value a = Value(std::string("a string longer than eight chars"));
+    Value b = a;
+    Value c;
+    c = b;
+    REQUIRE(b.string_data() == a.string_data());
+    REQUIRE(c.string_data() == a.string_data());
+    a = Value(1);
+    REQUIRE(c == "a string longer than eight chars");
+
+    // concatenating a copy leaves the original alone
+    auto s = get_stack("\"abcdefghijkl\" var s s s \"mnop\" + s");
+    REQUIRE(s.top() == "abcdefghijkl");
+    s.pop();
+    REQUIRE(s.top() == "abcdefghijklmnop");
+    s.pop();
+    REQUIRE(s.top() == "abcdefghijkl");
+}
+
+TEST_CASE("Indexing past either end of a string is an error", "[string index]") {
+    REQUIRE(get_top("\"abcdefghijkl\" 11 .") == "l");
+    REQUIRE(get_exit_code("\"abcdefghijkl\" 12 .") == 1);
+    REQUIRE(get_exit_code("\"abc\" 0 1 - .") == 1);
+    REQUIRE(get_exit_code("3 0 .") == 1);
+}